@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Settings kept in program flash.
+ *
+ * One 1KB erase page just below the page holding the configuration
+ * words is set aside and used as sixteen 64 byte slots, each written
+ * once with a single block write.  The last valid slot wins, and the
+ * page is only erased when all sixteen have been used.
+ *
+ *	[FLASH_MAGIC] [len] [len bytes] [checksum] [0xff...]
+ */
+
+#ifndef __FLASH_C__
+#define __FLASH_C__
+
+#include <string.h>
+
+#ifndef TBLWT_POSTINC		/* Allow lint to override */
+#define TBLWT_POSTINC()	do { __asm tblwt*+ __endasm; } while (0)
+#endif
+
+#define FLASH_PAGE	1024		// Erase size
+#define FLASH_BLOCK	64		// Write size
+#define FLASH_SLOTS	(FLASH_PAGE / FLASH_BLOCK)
+#define FLASH_CFG	(0x8000 - 2 * FLASH_PAGE)	// pic18f25j50
+#define FLASH_MAGIC	0xc5
+
+/*
+ * Keep the linker out of the settings page, and have it erased, not
+ * zeroed, when the image is flashed.
+ */
+#define FF4	0xff, 0xff, 0xff, 0xff
+#define FF16	FF4, FF4, FF4, FF4
+#define FF64	FF16, FF16, FF16, FF16
+#define FF256	FF64, FF64, FF64, FF64
+
+CTASSERT(FLASH_PAGE == 1024);	// Update the initializer
+
+static const code uint8_t at(FLASH_CFG) flash_cfg[FLASH_PAGE] = {
+	FF256, FF256, FF256, FF256
+};
+
+static uint8_t flash_buf[FLASH_BLOCK];
+
+static void
+flash_tblptr(uint16_t a)
+{
+
+	TBLPTRU = 0;
+	TBLPTRH = a >> 8;
+	TBLPTRL = a & 0xff;
+}
+
+/* The unlock sequence, the CPU stalls until the operation is done */
+static void
+flash_unlock(void)
+{
+	uint8_t s;
+
+	s = INTCON & 0xc0;
+	INTCON &= ~0xc0;
+	EECON1bits.WREN = 1;
+	EECON2 = 0x55;
+	EECON2 = 0xaa;
+	EECON1bits.WR = 1;
+	EECON1bits.WREN = 0;
+	INTCON |= s;
+}
+
+static void
+flash_erase(uint16_t a)
+{
+
+	ClrWdt();
+	flash_tblptr(a);
+	EECON1bits.FREE = 1;
+	flash_unlock();
+	EECON1bits.FREE = 0;
+}
+
+static void
+flash_write(uint16_t a, const uint8_t *p)
+{
+	uint8_t u;
+
+	ClrWdt();
+	flash_tblptr(a);
+	for (u = 0; u < FLASH_BLOCK; u++) {
+		TABLAT = p[u];
+		TBLWT_POSTINC();
+	}
+	flash_tblptr(a);		// Must point into the block
+	flash_unlock();
+}
+
+static uint8_t
+flash_sum(const uint8_t *p, uint8_t len)
+{
+	uint8_t s = FLASH_MAGIC;
+
+	while (len--)
+		s += *p++;
+	return (s);
+}
+
+/*
+ * Copy the newest saved record of len bytes to p, return 0 if there
+ * is none.
+ */
+static uint8_t
+flash_load(uint8_t *p, uint8_t len)
+{
+	const uint8_t *f, *last = 0;
+	uint8_t u;
+
+	for (u = 0; u < FLASH_SLOTS; u++) {
+		f = flash_cfg + u * FLASH_BLOCK;
+		if (f[0] == 0xff)
+			break;
+		if (f[0] == FLASH_MAGIC && f[1] == len &&
+		    flash_sum(f + 1, len + 1) == f[len + 2])
+			last = f;
+	}
+	if (last == 0)
+		return (0);
+	for (u = 0; u < len; u++)
+		p[u] = last[u + 2];
+	return (1);
+}
+
+static uint8_t
+flash_erased(const uint8_t *f)
+{
+	uint8_t u;
+
+	for (u = 0; u < FLASH_BLOCK; u++)
+		if (f[u] != 0xff)
+			return (0);
+	return (1);
+}
+
+static void
+flash_save(const uint8_t *p, uint8_t len)
+{
+	uint8_t u;
+
+	for (u = 0; u < FLASH_SLOTS; u++)
+		if (flash_erased(flash_cfg + u * FLASH_BLOCK))
+			break;
+	if (u == FLASH_SLOTS) {
+		flash_erase(FLASH_CFG);
+		u = 0;
+	}
+	memset(flash_buf, 0xff, sizeof flash_buf);
+	flash_buf[0] = FLASH_MAGIC;
+	flash_buf[1] = len;
+	memcpy(flash_buf + 2, p, len);
+	flash_buf[len + 2] = flash_sum(flash_buf + 1, len + 1);
+	flash_write(FLASH_CFG + u * FLASH_BLOCK, flash_buf);
+}
+
+#endif /* __FLASH_C__ */
@@ -0,0 +1,171 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Framed output for EP1 IN.
+ *
+ * Every USB packet carries one frame:
+ *
+ *	[type] [seq] [len] [len bytes of payload] [crc16 lo] [crc16 hi]
+ *
+ * The CRC is CRC-16/CCITT (0x1021, preset 0xffff) over seq, len and
+ * the payload.  The last FRAME_WINDOW frames are kept, the host can
+ * ask for any of them again with 'R' followed by the sequence number
+ * on the OUT pipe.  A request for a frame which has left the window
+ * is answered with an empty FRAME_GONE frame.
+ */
+
+#ifndef __FRAME_C__
+#define __FRAME_C__
+
+#include <string.h>
+
+#define FRAME_WINDOW	8	// Power of two
+#define FRAME_HDR	3
+#define FRAME_TRL	2
+#define FRAME_PAYLOAD	(PIPE_1_SZ_IN - FRAME_HDR - FRAME_TRL)
+
+#define FRAME_DATA	0xa5
+#define FRAME_GONE	0xa6
+
+CTASSERT((FRAME_WINDOW & (FRAME_WINDOW - 1)) == 0);
+
+static uint8_t frame_buf[FRAME_WINDOW][PIPE_1_SZ_IN];
+static uint8_t frame_gone[FRAME_HDR + FRAME_TRL];
+static uint8_t frame_seq;		// Sequence number of next frame
+static uint8_t frame_built;		// frame_seq is built, not yet sent
+
+static uint8_t frame_rsq[FRAME_WINDOW];	// Resend requests
+static uint8_t frame_rsr, frame_rsw;
+
+static const code uint16_t crc16_tbl[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+static uint16_t
+crc16(uint16_t crc, const uint8_t *p, uint8_t len)
+{
+	uint8_t c;
+
+	while (len--) {
+		c = *p++;
+		crc = (crc << 4) ^ crc16_tbl[(uint8_t)(crc >> 12) ^ (c >> 4)];
+		crc = (crc << 4) ^ crc16_tbl[(uint8_t)(crc >> 12) ^ (c & 0xf)];
+	}
+	return (crc);
+}
+
+static void
+frame_seal(uint8_t *f, uint8_t type, uint8_t seq, uint8_t len)
+{
+	uint16_t crc;
+
+	f[0] = type;
+	f[1] = seq;
+	f[2] = len;
+	crc = crc16(0xffff, f + 1, len + 2);
+	f[FRAME_HDR + len] = crc & 0xff;
+	f[FRAME_HDR + len + 1] = crc >> 8;
+}
+
+static void
+frame_init(void)
+{
+
+	frame_seq = 0;
+	frame_built = 0;
+	frame_rsr = frame_rsw = 0;
+}
+
+/*
+ * Queue a resend of frame seq, called with the byte following 'R'.
+ */
+static void
+frame_request(uint8_t seq)
+{
+
+	if ((uint8_t)(frame_rsw - frame_rsr) >= FRAME_WINDOW)
+		return;				// Host will ask again
+	frame_rsq[frame_rsw++ & (FRAME_WINDOW - 1)] = seq;
+}
+
+/*
+ * Move up to FRAME_PAYLOAD bytes from buf into the next frame and
+ * return how many were taken.  Nothing is taken while the previous
+ * frame is still waiting for EP1.
+ */
+static uint8_t
+frame_build(uint8_t *buf, uint8_t len)
+{
+	uint8_t *f;
+
+	if (frame_built || len == 0)
+		return (0);
+	if (len > FRAME_PAYLOAD)
+		len = FRAME_PAYLOAD;
+	f = frame_buf[frame_seq & (FRAME_WINDOW - 1)];
+	memcpy(f + FRAME_HDR, buf, len);
+	frame_seal(f, FRAME_DATA, frame_seq, len);
+	frame_built = 1;
+	return (len);
+}
+
+/*
+ * Hand resends and then the built frame to EP1.  Returns 0 while
+ * the pipe is busy.
+ */
+static uint8_t
+frame_push(void)
+{
+	uint8_t s, *f;
+
+	while (frame_rsr != frame_rsw) {
+		s = frame_rsq[frame_rsr & (FRAME_WINDOW - 1)];
+		if ((uint8_t)(frame_seq - s - 1) < FRAME_WINDOW - frame_built) {
+			f = frame_buf[s & (FRAME_WINDOW - 1)];
+		} else {
+			f = frame_gone;
+			frame_seal(f, FRAME_GONE, s, 0);
+		}
+		if (InPipe(1, f, f[2] + FRAME_HDR + FRAME_TRL) == 0)
+			return (0);
+		frame_rsr++;
+	}
+	if (!frame_built)
+		return (1);
+	f = frame_buf[frame_seq & (FRAME_WINDOW - 1)];
+	if (InPipe(1, f, f[2] + FRAME_HDR + FRAME_TRL) == 0)
+		return (0);
+	frame_built = 0;
+	frame_seq++;
+	return (1);
+}
+
+#endif /* __FRAME_C__ */
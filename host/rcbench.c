@@ -0,0 +1,184 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Benchmark the rcdec implementations against each other.
+ *
+ *	rcbench [-g gigabytes] [-c chunk] [-e bad-per-million]
+ *
+ * A 64MB hex stream is generated once, with text lines and truncated
+ * records sprinkled in at the given rate.  One untimed pass over it
+ * checks that every implementation produces the same output and bad
+ * count as the scalar one, then it is fed repeatedly in chunks until
+ * the requested volume has passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rcdec.h"
+
+#define GENSZ	(64 << 20)
+
+static const char hex[] = "0123456789abcdef";
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static size_t
+gen(uint8_t *buf, size_t sz, unsigned ppm)
+{
+	static const char text[] = "job done, 12345 characters\r\n";
+	uint8_t *p = buf, *e = buf + sz - sizeof text;
+	unsigned r = 1;
+	unsigned c;
+
+	while (p < e) {
+		r = r * 1103515245 + 12345;
+		c = (r >> 16) & 0xff;
+		if (ppm > 0 && (r >> 8) % 1000000 < ppm) {
+			if (c & 1) {
+				memcpy(p, text, sizeof text - 1);
+				p += sizeof text - 1;
+			} else {
+				/* Truncated record */
+				*p++ = hex[c >> 4];
+				*p++ = '\r';
+				*p++ = '\n';
+			}
+			continue;
+		}
+		*p++ = hex[c >> 4];
+		*p++ = hex[c & 0xf];
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	return (p - buf);
+}
+
+static uint64_t
+hash(uint64_t h, const uint8_t *p, size_t n)
+{
+
+	while (n--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+	return (h);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *name[] = { NULL, "scalar", "sse2", "avx2" };
+	struct rcdec d;
+	uint8_t *buf, *out;
+	size_t len, off, n, m, chunk = 65536 + 3;
+	uint64_t total, ref_h = 0, ref_bad = 0, h;
+	double gb = 4, t0, t;
+	unsigned ppm = 0;
+	int ch, impl, bad = 0, check;
+
+	while ((ch = getopt(argc, argv, "c:e:g:")) != -1) {
+		switch (ch) {
+		case 'c':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			ppm = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gb = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr,
+			    "usage: rcbench [-g gigabytes] [-c chunk] "
+			    "[-e bad-per-million]\n");
+			exit(2);
+		}
+	}
+	if (chunk == 0 || chunk > GENSZ) {
+		fprintf(stderr, "rcbench: bad chunk size\n");
+		exit(2);
+	}
+	buf = malloc(GENSZ);
+	out = malloc(RCDEC_OUTSZ(chunk));
+	if (buf == NULL || out == NULL) {
+		perror("malloc");
+		exit(2);
+	}
+	len = gen(buf, GENSZ, ppm);
+	total = (uint64_t)(gb * 1e9);
+
+	for (impl = RCDEC_SCALAR; impl <= RCDEC_AVX2; impl++) {
+		(void)rcdec_init(&d, RCDEC_HEX);
+		if (rcdec_impl(&d, impl)) {
+			printf("%-7s not supported\n", name[impl]);
+			continue;
+		}
+		h = 0xcbf29ce484222325ULL;
+		for (off = 0; off < len; off += n) {
+			n = len - off < chunk ? len - off : chunk;
+			m = rcdec_feed(&d, buf + off, n, out);
+			h = hash(h, out, m);
+		}
+		rcdec_finish(&d);
+		if (impl == RCDEC_SCALAR) {
+			ref_h = h;
+			ref_bad = d.nbad;
+		}
+		check = h == ref_h && d.nbad == ref_bad;
+		if (!check)
+			bad = 1;
+
+		(void)rcdec_init(&d, RCDEC_HEX);
+		(void)rcdec_impl(&d, impl);
+		t0 = now();
+		for (off = 0; d.nin < total; off += n) {
+			if (off >= len)
+				off = 0;
+			n = len - off < chunk ? len - off : chunk;
+			(void)rcdec_feed(&d, buf + off, n, out);
+		}
+		rcdec_finish(&d);
+		t = now() - t0;
+		printf("%-7s %8.2f GB in %6.3f s %8.2f GB/s  %ju out %ju bad%s\n",
+		    d.impl, d.nin * 1e-9, t, d.nin * 1e-9 / t,
+		    (uintmax_t)d.nout, (uintmax_t)d.nbad,
+		    check ? "" : "  MISMATCH");
+	}
+	exit(bad);
+}
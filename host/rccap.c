@@ -0,0 +1,898 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Capture container, writer and mmap(2) reader, see rccap.h
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rccap.h"
+
+#define RCC_MAGIC	"RCck"
+#define RCC_PAD(n)	(((n) + 7) & ~(size_t)7)
+#define RCC_ENTSZ	24
+#define RCC_TAILSZ	(RCC_HDRSZ + 24)
+
+/*--------------------------------------------------------------------*/
+
+static void
+enc16(uint8_t *p, uint16_t v)
+{
+
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void
+enc32(uint8_t *p, uint32_t v)
+{
+
+	enc16(p, v);
+	enc16(p + 2, v >> 16);
+}
+
+static void
+enc64(uint8_t *p, uint64_t v)
+{
+
+	enc32(p, v);
+	enc32(p + 4, v >> 32);
+}
+
+static uint16_t
+dec16(const uint8_t *p)
+{
+
+	return (p[0] | p[1] << 8);
+}
+
+static uint32_t
+dec32(const uint8_t *p)
+{
+
+	return (dec16(p) | (uint32_t)dec16(p + 2) << 16);
+}
+
+static uint64_t
+dec64(const uint8_t *p)
+{
+
+	return (dec32(p) | (uint64_t)dec32(p + 4) << 32);
+}
+
+/*--------------------------------------------------------------------*/
+
+uint32_t
+rcc_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	static uint32_t tbl[256];
+	const uint8_t *p = buf;
+	uint32_t c;
+	unsigned i, j;
+
+	if (tbl[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+			tbl[i] = c;
+		}
+	}
+	crc = ~crc;
+	while (len--)
+		crc = tbl[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return (~crc);
+}
+
+/*--------------------------------------------------------------------
+ * Index under construction, in the on-disk layout so the reader can
+ * use one built in memory the same way as one mapped from the file.
+ */
+
+struct rcc_ix {
+	uint8_t		*ent;
+	unsigned	nent;
+	unsigned	ment;
+	uint64_t	*meta;
+	unsigned	nmeta;
+	unsigned	mmeta;
+	uint8_t		*stab;
+	unsigned	nstab;
+};
+
+static int
+ix_data(struct rcc_ix *ix, uint64_t foff, uint64_t off, uint32_t len,
+    uint32_t ms)
+{
+	uint8_t *p;
+
+	if (ix->nent == ix->ment) {
+		p = realloc(ix->ent, (ix->ment * 2 + 64) * RCC_ENTSZ);
+		if (p == NULL)
+			return (-1);
+		ix->ent = p;
+		ix->ment = ix->ment * 2 + 64;
+	}
+	p = ix->ent + ix->nent++ * RCC_ENTSZ;
+	enc64(p, foff);
+	enc64(p + 8, off);
+	enc32(p + 16, len);
+	enc32(p + 20, ms);
+	return (0);
+}
+
+static int
+ix_meta(struct rcc_ix *ix, uint64_t foff)
+{
+	uint64_t *p;
+
+	if (ix->nmeta == ix->mmeta) {
+		p = realloc(ix->meta, (ix->mmeta * 2 + 8) * sizeof *p);
+		if (p == NULL)
+			return (-1);
+		ix->meta = p;
+		ix->mmeta = ix->mmeta * 2 + 8;
+	}
+	ix->meta[ix->nmeta++] = foff;
+	return (0);
+}
+
+/* Stride table:  the first chunk still holding offset N * stride */
+static int
+ix_strides(struct rcc_ix *ix, uint64_t total, uint32_t stride)
+{
+	const uint8_t *e;
+	unsigned g, i;
+
+	ix->nstab = (total + stride - 1) / stride;
+	free(ix->stab);
+	ix->stab = malloc(ix->nstab * 4 + 1);
+	if (ix->stab == NULL)
+		return (-1);
+	for (g = i = 0; g < ix->nstab; g++) {
+		for (; i + 1 < ix->nent; i++) {
+			e = ix->ent + i * RCC_ENTSZ;
+			if (dec64(e + 8) + dec32(e + 16) > (uint64_t)g * stride)
+				break;
+		}
+		enc32(ix->stab + g * 4, i);
+	}
+	return (0);
+}
+
+static void
+ix_free(struct rcc_ix *ix)
+{
+
+	free(ix->ent);
+	free(ix->meta);
+	free(ix->stab);
+	memset(ix, 0, sizeof *ix);
+}
+
+/*--------------------------------------------------------------------*/
+
+static uint32_t
+now_ms(uint64_t t0)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((ts.tv_sec * 1000000000ULL + ts.tv_nsec - t0) / 1000000);
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t i;
+
+	while (len > 0) {
+		i = write(fd, p, len);
+		if (i < 0 && errno == EINTR)
+			continue;
+		if (i <= 0)
+			return (-1);
+		p += i;
+		len -= i;
+	}
+	return (0);
+}
+
+/* Write one chunk, return the number of bytes it took */
+static ssize_t
+chunk_put(int fd, unsigned type, uint64_t off, uint32_t ms,
+    const struct iovec *iov, int niov)
+{
+	static const uint8_t zero[8];
+	uint8_t hdr[RCC_HDRSZ];
+	uint32_t crc = 0;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < niov; i++) {
+		crc = rcc_crc32(crc, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	memcpy(hdr, RCC_MAGIC, 4);
+	enc16(hdr + 4, type);
+	enc16(hdr + 6, 0);
+	enc32(hdr + 8, len);
+	enc32(hdr + 12, crc);
+	enc64(hdr + 16, off);
+	enc32(hdr + 24, ms);
+	enc32(hdr + 28, rcc_crc32(0, hdr, 28));
+	if (write_all(fd, hdr, sizeof hdr))
+		return (-1);
+	for (i = 0; i < niov; i++)
+		if (write_all(fd, iov[i].iov_base, iov[i].iov_len))
+			return (-1);
+	if (write_all(fd, zero, RCC_PAD(len) - len))
+		return (-1);
+	return (RCC_HDRSZ + RCC_PAD(len));
+}
+
+/* Write INDEX at file offset foff, and TAIL after it */
+static int
+ix_put(int fd, uint64_t foff, struct rcc_ix *ix, uint32_t stride,
+    uint64_t total, uint32_t crc, uint32_t ms)
+{
+	struct iovec iov[4];
+	uint8_t h[16], t[24], *m;
+	unsigned u;
+	int r = -1;
+
+	if (ix_strides(ix, total, stride))
+		return (-1);
+	m = malloc(ix->nmeta * 8 + 1);
+	if (m == NULL)
+		return (-1);
+	for (u = 0; u < ix->nmeta; u++)
+		enc64(m + u * 8, ix->meta[u]);
+	enc32(h, ix->nent);
+	enc32(h + 4, stride);
+	enc32(h + 8, ix->nstab);
+	enc32(h + 12, ix->nmeta);
+	iov[0].iov_base = h;
+	iov[0].iov_len = sizeof h;
+	iov[1].iov_base = ix->ent;
+	iov[1].iov_len = ix->nent * RCC_ENTSZ;
+	iov[2].iov_base = m;
+	iov[2].iov_len = ix->nmeta * 8;
+	iov[3].iov_base = ix->stab;
+	iov[3].iov_len = ix->nstab * 4;
+	if (chunk_put(fd, RCC_INDEX, total, ms, iov, 4) > 0) {
+		enc64(t, foff);
+		enc64(t + 8, total);
+		enc32(t + 16, crc);
+		enc32(t + 20, ix->nent);
+		iov[0].iov_base = t;
+		iov[0].iov_len = sizeof t;
+		if (chunk_put(fd, RCC_TAIL, total, ms, iov, 1) > 0)
+			r = 0;
+	}
+	free(m);
+	return (r);
+}
+
+/*--------------------------------------------------------------------*/
+
+struct rcc_w {
+	int		fd;
+	uint32_t	stride;
+	uint8_t		*buf;
+	size_t		nbuf;
+	uint64_t	foff;		/* File offset of next chunk */
+	uint64_t	off;		/* Stream offset of buf[0] */
+	uint32_t	crc;
+	uint64_t	t0;
+	struct rcc_ix	ix;
+	int		err;
+};
+
+struct rcc_w *
+rcc_create(int fd, uint32_t stride)
+{
+	struct rcc_w *w;
+	struct timespec ts;
+	struct iovec iov;
+	uint8_t h[16];
+	ssize_t i;
+
+	if (stride == 0)
+		stride = RCC_STRIDE;
+	w = calloc(1, sizeof *w);
+	if (w == NULL)
+		return (NULL);
+	w->buf = malloc(stride);
+	if (w->buf == NULL) {
+		free(w);
+		return (NULL);
+	}
+	w->fd = fd;
+	w->stride = stride;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	w->t0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	enc32(h, RCC_VERSION);
+	enc32(h + 4, stride);
+	enc64(h + 8, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+	iov.iov_base = h;
+	iov.iov_len = sizeof h;
+	i = chunk_put(fd, RCC_HEAD, 0, 0, &iov, 1);
+	if (i < 0) {
+		free(w->buf);
+		free(w);
+		return (NULL);
+	}
+	w->foff = i;
+	return (w);
+}
+
+int
+rcc_meta(struct rcc_w *w, const char *key, const char *val)
+{
+	struct iovec iov[4];
+	ssize_t i;
+
+	if (w->err || *key == '\0' || strpbrk(key, "=\n") != NULL ||
+	    strchr(val, '\n') != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	iov[0].iov_base = (void *)(uintptr_t)key;
+	iov[0].iov_len = strlen(key);
+	iov[1].iov_base = (void *)(uintptr_t)"=";
+	iov[1].iov_len = 1;
+	iov[2].iov_base = (void *)(uintptr_t)val;
+	iov[2].iov_len = strlen(val);
+	iov[3].iov_base = (void *)(uintptr_t)"\n";
+	iov[3].iov_len = 1;
+	if (ix_meta(&w->ix, w->foff))
+		return (w->err = -1);
+	i = chunk_put(w->fd, RCC_META, w->off + w->nbuf, now_ms(w->t0),
+	    iov, 4);
+	if (i < 0)
+		return (w->err = -1);
+	w->foff += i;
+	return (0);
+}
+
+int
+rcc_flush(struct rcc_w *w)
+{
+	struct iovec iov;
+	uint32_t ms;
+	ssize_t i;
+
+	if (w->err)
+		return (-1);
+	if (w->nbuf == 0)
+		return (0);
+	ms = now_ms(w->t0);
+	iov.iov_base = w->buf;
+	iov.iov_len = w->nbuf;
+	if (ix_data(&w->ix, w->foff, w->off, w->nbuf, ms))
+		return (w->err = -1);
+	i = chunk_put(w->fd, RCC_DATA, w->off, ms, &iov, 1);
+	if (i < 0)
+		return (w->err = -1);
+	w->foff += i;
+	w->crc = rcc_crc32(w->crc, w->buf, w->nbuf);
+	w->off += w->nbuf;
+	w->nbuf = 0;
+	return (0);
+}
+
+int
+rcc_write(struct rcc_w *w, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t n;
+
+	while (len > 0) {
+		n = w->stride - w->nbuf;
+		if (n > len)
+			n = len;
+		memcpy(w->buf + w->nbuf, p, n);
+		w->nbuf += n;
+		p += n;
+		len -= n;
+		if (w->nbuf == w->stride && rcc_flush(w))
+			return (-1);
+	}
+	return (w->err);
+}
+
+int
+rcc_close(struct rcc_w *w)
+{
+	int r;
+
+	r = rcc_flush(w);
+	if (r == 0)
+		r = ix_put(w->fd, w->foff, &w->ix, w->stride, w->off, w->crc,
+		    now_ms(w->t0));
+	ix_free(&w->ix);
+	free(w->buf);
+	free(w);
+	return (r);
+}
+
+/*--------------------------------------------------------------------*/
+
+struct rcc_r {
+	const uint8_t	*base;
+	size_t		size;
+	size_t		end;		/* After the last good chunk */
+	int		indexed;
+	uint32_t	stride;
+	uint64_t	start;
+	uint64_t	total;
+	uint32_t	crc;		/* Of the stream, if indexed */
+
+	/* Either mapped from the file or built by scanning it */
+	const uint8_t	*ent;
+	unsigned	nent;
+	const uint8_t	*stab;
+	unsigned	nstab;
+	struct rcc_ix	ix;
+
+	char		*metabuf;
+	char		**key;
+	char		**val;
+	unsigned	nmeta;
+};
+
+/* Header at foff if it is sane and the chunk fits, else NULL */
+static const uint8_t *
+chunk_hdr(const struct rcc_r *r, uint64_t foff, unsigned type)
+{
+	const uint8_t *h;
+
+	if (foff > r->size || r->size - foff < RCC_HDRSZ)
+		return (NULL);
+	h = r->base + foff;
+	if (memcmp(h, RCC_MAGIC, 4) || dec32(h + 28) != rcc_crc32(0, h, 28))
+		return (NULL);
+	if (type != 0 && dec16(h + 4) != type)
+		return (NULL);
+	if (RCC_PAD((uint64_t)dec32(h + 8)) > r->size - foff - RCC_HDRSZ)
+		return (NULL);
+	return (h);
+}
+
+static int
+chunk_ok(const uint8_t *h)
+{
+
+	return (rcc_crc32(0, h + RCC_HDRSZ, dec32(h + 8)) == dec32(h + 12));
+}
+
+static int
+rd_index(struct rcc_r *r)
+{
+	const uint8_t *t, *h, *p, *e;
+	uint64_t foff, off;
+	size_t len;
+	unsigned i;
+
+	if (r->size < RCC_TAILSZ)
+		return (-1);
+	t = chunk_hdr(r, r->size - RCC_TAILSZ, RCC_TAIL);
+	if (t == NULL || dec32(t + 8) != 24 || !chunk_ok(t))
+		return (-1);
+	foff = dec64(t + RCC_HDRSZ);
+	h = chunk_hdr(r, foff, RCC_INDEX);
+	if (h == NULL || !chunk_ok(h))
+		return (-1);
+	p = h + RCC_HDRSZ;
+	len = dec32(h + 8);
+	if (len < 16)
+		return (-1);
+	r->nent = dec32(p);
+	r->nstab = dec32(p + 8);
+	r->nmeta = dec32(p + 12);
+	if (dec32(p + 4) != r->stride || len != 16 +
+	    (uint64_t)r->nent * RCC_ENTSZ + r->nmeta * 8ULL + r->nstab * 4ULL)
+		return (-1);
+	r->ent = p + 16;
+	r->stab = r->ent + r->nent * RCC_ENTSZ + r->nmeta * 8;
+	r->total = dec64(t + RCC_HDRSZ + 8);
+	r->crc = dec32(t + RCC_HDRSZ + 16);
+	r->end = foff;
+
+	/* Everything handed out later points into the mapping from here */
+	for (i = 0, off = 0; i < r->nent; i++) {
+		e = r->ent + i * RCC_ENTSZ;
+		if (dec64(e) >= foff || dec64(e + 8) != off ||
+		    RCC_HDRSZ + (uint64_t)dec32(e + 16) > foff - dec64(e))
+			return (-1);
+		off += dec32(e + 16);
+	}
+	if (off != r->total ||
+	    r->nstab < (r->total + r->stride - 1) / r->stride)
+		return (-1);
+	for (i = 0; i < r->nstab; i++)
+		if (dec32(r->stab + i * 4) > r->nent)
+			return (-1);
+	r->indexed = 1;
+	return (0);
+}
+
+/* No index, walk the chunks as far as they go */
+static int
+rd_scan(struct rcc_r *r)
+{
+	const uint8_t *h;
+	uint64_t foff, off = 0;
+	uint32_t len;
+
+	for (foff = 0; (h = chunk_hdr(r, foff, 0)) != NULL;
+	    foff += RCC_HDRSZ + RCC_PAD(len)) {
+		len = dec32(h + 8);
+		if (dec16(h + 4) == RCC_DATA) {
+			if (dec64(h + 16) != off)
+				break;
+			if (ix_data(&r->ix, foff, off, len, dec32(h + 24)))
+				return (-1);
+			off += len;
+		} else if (dec16(h + 4) == RCC_META) {
+			if (ix_meta(&r->ix, foff))
+				return (-1);
+		} else if (dec16(h + 4) != RCC_HEAD || foff != 0)
+			break;
+	}
+	if (ix_strides(&r->ix, off, r->stride))
+		return (-1);
+	r->end = foff;
+	r->ent = r->ix.ent;
+	r->nent = r->ix.nent;
+	r->stab = r->ix.stab;
+	r->nstab = r->ix.nstab;
+	r->nmeta = r->ix.nmeta;
+	r->total = off;
+	return (0);
+}
+
+static uint64_t
+meta_foff(const struct rcc_r *r, unsigned i)
+{
+
+	if (r->indexed)
+		return (dec64(r->ent + r->nent * RCC_ENTSZ + i * 8));
+	return (r->ix.meta[i]);
+}
+
+/* Copy out the META lines and split them, "key=value" */
+static int
+rd_meta(struct rcc_r *r)
+{
+	const uint8_t *h;
+	size_t len, tot = 0;
+	unsigned i, n = 0;
+	char *p, *q, *e;
+
+	for (i = 0; i < r->nmeta; i++) {
+		h = chunk_hdr(r, meta_foff(r, i), RCC_META);
+		if (h == NULL)
+			return (-1);
+		tot += dec32(h + 8) + 1;
+	}
+	r->metabuf = malloc(tot + 1);
+	r->key = calloc(tot + 1, sizeof *r->key);
+	r->val = calloc(tot + 1, sizeof *r->val);
+	if (r->metabuf == NULL || r->key == NULL || r->val == NULL)
+		return (-1);
+	p = r->metabuf;
+	for (i = 0; i < r->nmeta; i++) {
+		h = chunk_hdr(r, meta_foff(r, i), RCC_META);
+		len = dec32(h + 8);
+		memcpy(p, h + RCC_HDRSZ, len);
+		p[len] = '\0';
+		for (e = p + len; p < e; p = q + 1) {
+			q = strchr(p, '\n');
+			if (q == NULL)
+				q = e;
+			*q = '\0';
+			r->key[n] = p;
+			p = strchr(p, '=');
+			if (p == NULL)
+				r->val[n] = q;
+			else {
+				*p = '\0';
+				r->val[n] = p + 1;
+			}
+			n++;
+		}
+		p = e + 1;
+	}
+	r->nmeta = n;
+	return (0);
+}
+
+struct rcc_r *
+rcc_open(const char *path, char *err, size_t errlen)
+{
+	struct rcc_r *r;
+	struct stat st;
+	const uint8_t *h;
+	void *m;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		if (fd >= 0)
+			(void)close(fd);
+		return (NULL);
+	}
+	if (st.st_size < RCC_HDRSZ + 16) {
+		snprintf(err, errlen, "not a capture container");
+		(void)close(fd);
+		return (NULL);
+	}
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (m == MAP_FAILED) {
+		snprintf(err, errlen, "mmap: %s", strerror(errno));
+		return (NULL);
+	}
+	r = calloc(1, sizeof *r);
+	if (r == NULL) {
+		(void)munmap(m, st.st_size);
+		snprintf(err, errlen, "out of memory");
+		return (NULL);
+	}
+	r->base = m;
+	r->size = st.st_size;
+
+	h = chunk_hdr(r, 0, RCC_HEAD);
+	if (h == NULL || !chunk_ok(h) || dec32(h + RCC_HDRSZ) != RCC_VERSION ||
+	    dec32(h + RCC_HDRSZ + 4) == 0) {
+		snprintf(err, errlen, "not a capture container");
+		rcc_free(r);
+		return (NULL);
+	}
+	r->stride = dec32(h + RCC_HDRSZ + 4);
+	r->start = dec64(h + RCC_HDRSZ + 8);
+	if ((rd_index(r) && rd_scan(r)) || rd_meta(r)) {
+		snprintf(err, errlen, "cannot read index");
+		rcc_free(r);
+		return (NULL);
+	}
+	return (r);
+}
+
+void
+rcc_free(struct rcc_r *r)
+{
+
+	if (r->base != NULL)
+		(void)munmap((void *)(uintptr_t)r->base, r->size);
+	ix_free(&r->ix);
+	free(r->metabuf);
+	free(r->key);
+	free(r->val);
+	free(r);
+}
+
+int
+rcc_indexed(const struct rcc_r *r)
+{
+
+	return (r->indexed);
+}
+
+uint64_t
+rcc_size(const struct rcc_r *r)
+{
+
+	return (r->total);
+}
+
+/* CRC-32 of the stream as the writer saw it, if indexed */
+uint32_t
+rcc_crc(const struct rcc_r *r)
+{
+
+	return (r->crc);
+}
+
+uint64_t
+rcc_start(const struct rcc_r *r)
+{
+
+	return (r->start);
+}
+
+unsigned
+rcc_nmeta(const struct rcc_r *r)
+{
+
+	return (r->nmeta);
+}
+
+int
+rcc_meta_get(const struct rcc_r *r, unsigned i, const char **key,
+    const char **val)
+{
+
+	if (i >= r->nmeta)
+		return (-1);
+	*key = r->key[i];
+	*val = r->val[i];
+	return (0);
+}
+
+/* The last value given for key */
+const char *
+rcc_meta_find(const struct rcc_r *r, const char *key)
+{
+	unsigned i;
+
+	for (i = r->nmeta; i-- > 0; )
+		if (!strcmp(r->key[i], key))
+			return (r->val[i]);
+	return (NULL);
+}
+
+unsigned
+rcc_nchunks(const struct rcc_r *r)
+{
+
+	return (r->nent);
+}
+
+const uint8_t *
+rcc_chunk(const struct rcc_r *r, unsigned i, uint64_t *off, size_t *len,
+    uint32_t *ms)
+{
+	const uint8_t *e;
+
+	if (i >= r->nent)
+		return (NULL);
+	e = r->ent + i * RCC_ENTSZ;
+	if (off != NULL)
+		*off = dec64(e + 8);
+	if (len != NULL)
+		*len = dec32(e + 16);
+	if (ms != NULL)
+		*ms = dec32(e + 20);
+	return (r->base + dec64(e) + RCC_HDRSZ);
+}
+
+/* 1 if the chunk checks out, 0 if not */
+int
+rcc_verify(const struct rcc_r *r, unsigned i)
+{
+	const uint8_t *e, *h;
+
+	if (i >= r->nent)
+		return (0);
+	e = r->ent + i * RCC_ENTSZ;
+	h = chunk_hdr(r, dec64(e), RCC_DATA);
+	return (h != NULL && dec32(h + 8) == dec32(e + 16) &&
+	    dec64(h + 16) == dec64(e + 8) && chunk_ok(h));
+}
+
+/*
+ * Where stream offset off is in the mapping, and how many bytes
+ * follow it contiguously.
+ */
+const uint8_t *
+rcc_at(const struct rcc_r *r, uint64_t off, size_t *len)
+{
+	const uint8_t *e;
+	uint64_t g, o;
+	uint32_t l;
+	unsigned lo, hi, i;
+
+	if (off >= r->total)
+		return (NULL);
+	g = off / r->stride;
+	if (g >= r->nstab)
+		return (NULL);
+	/* Short chunks from flushes can make a stride many entries */
+	lo = dec32(r->stab + g * 4);
+	hi = g + 1 < r->nstab ? dec32(r->stab + (g + 1) * 4) + 1 : r->nent;
+	if (hi > r->nent)
+		hi = r->nent;
+	while (hi - lo > 1) {
+		i = lo + (hi - lo) / 2;
+		if (dec64(r->ent + i * RCC_ENTSZ + 8) <= off)
+			lo = i;
+		else
+			hi = i;
+	}
+	if (lo >= r->nent)
+		return (NULL);
+	e = r->ent + lo * RCC_ENTSZ;
+	o = dec64(e + 8);
+	l = dec32(e + 16);
+	if (off < o || off >= o + l)
+		return (NULL);
+	*len = o + l - off;
+	return (r->base + dec64(e) + RCC_HDRSZ + (off - o));
+}
+
+int
+rcc_repair(const char *path, char *err, size_t errlen)
+{
+	struct rcc_r *r;
+	const uint8_t *p;
+	uint32_t crc = 0, ms = 0;
+	uint64_t end;
+	unsigned i;
+	size_t len;
+	int fd, ret;
+
+	r = rcc_open(path, err, errlen);
+	if (r == NULL)
+		return (-1);
+	if (r->indexed) {
+		snprintf(err, errlen, "already indexed");
+		rcc_free(r);
+		return (-1);
+	}
+	for (i = 0; i < r->nent; i++) {
+		p = rcc_chunk(r, i, NULL, &len, &ms);
+		crc = rcc_crc32(crc, p, len);
+	}
+	end = r->end;
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || ftruncate(fd, end) || lseek(fd, end, SEEK_SET) < 0) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		if (fd >= 0)
+			(void)close(fd);
+		rcc_free(r);
+		return (-1);
+	}
+	ret = ix_put(fd, end, &r->ix, r->stride, r->total, crc, ms);
+	if (ret)
+		snprintf(err, errlen, "write: %s", strerror(errno));
+	if (close(fd) && ret == 0) {
+		snprintf(err, errlen, "close: %s", strerror(errno));
+		ret = -1;
+	}
+	rcc_free(r);
+	return (ret);
+}
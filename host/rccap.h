@@ -0,0 +1,117 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Capture container for the RC-2000 adapter.
+ *
+ * A container is a sequence of chunks, each with a 32 byte header,
+ * all fields little endian:
+ *
+ *	 0	"RCck"
+ *	 4	u16 type
+ *	 6	u16 flags, zero
+ *	 8	u32 payload length
+ *	12	u32 CRC-32 of the payload
+ *	16	u64 stream offset: of the first byte for DATA, else the
+ *		    length of the stream so far
+ *	24	u32 milliseconds since the capture started
+ *	28	u32 CRC-32 of bytes 0...27
+ *
+ * The payload follows, padded with zeros to a multiple of 8 bytes.
+ * The CRC-32 is the one the adapter reports with 'C', so the CRC of
+ * a whole capture can be checked against the reader.
+ *
+ *	HEAD	first chunk: u32 version, u32 stride, u64 start time in
+ *		nanoseconds since the epoch
+ *	META	"key=value\n" lines, may appear anywhere
+ *	DATA	captured bytes
+ *	INDEX	u32 DATA chunks, u32 stride, u32 strides, u32 META chunks,
+ *		then per DATA chunk u64 file offset, u64 stream offset,
+ *		u32 length, u32 milliseconds, then per META chunk u64 file
+ *		offset, then per stride u32 index of the DATA chunk holding
+ *		stream offset N * stride
+ *	TAIL	last chunk: u64 file offset of INDEX, u64 stream length,
+ *		u32 CRC-32 of the stream, u32 DATA chunks
+ *
+ * The writer only ever appends, and makes a DATA chunk whenever it has
+ * stride bytes or is told to flush, so a capture in progress can be
+ * followed with tail -f.  INDEX and TAIL come last; without them, as
+ * after a crash, the reader scans the chunks and builds the index in
+ * memory.  With the stride table, finding the chunk for an offset
+ * takes one lookup plus a step past any short chunks from flushes.
+ */
+
+#ifndef RCCAP_H
+#define RCCAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RCC_VERSION	1
+#define RCC_STRIDE	65536
+#define RCC_HDRSZ	32
+
+#define RCC_HEAD	1
+#define RCC_META	2
+#define RCC_DATA	3
+#define RCC_INDEX	4
+#define RCC_TAIL	5
+
+uint32_t rcc_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* Writer */
+struct rcc_w;
+struct rcc_w *rcc_create(int fd, uint32_t stride);
+int rcc_meta(struct rcc_w *w, const char *key, const char *val);
+int rcc_write(struct rcc_w *w, const void *buf, size_t len);
+int rcc_flush(struct rcc_w *w);
+int rcc_close(struct rcc_w *w);
+
+/* Reader, the file is mapped and data is handed out in place */
+struct rcc_r;
+struct rcc_r *rcc_open(const char *path, char *err, size_t errlen);
+int rcc_indexed(const struct rcc_r *r);
+uint64_t rcc_size(const struct rcc_r *r);
+uint64_t rcc_start(const struct rcc_r *r);
+uint32_t rcc_crc(const struct rcc_r *r);
+unsigned rcc_nmeta(const struct rcc_r *r);
+int rcc_meta_get(const struct rcc_r *r, unsigned i, const char **key,
+    const char **val);
+const char *rcc_meta_find(const struct rcc_r *r, const char *key);
+unsigned rcc_nchunks(const struct rcc_r *r);
+const uint8_t *rcc_chunk(const struct rcc_r *r, unsigned i, uint64_t *off,
+    size_t *len, uint32_t *ms);
+int rcc_verify(const struct rcc_r *r, unsigned i);
+const uint8_t *rcc_at(const struct rcc_r *r, uint64_t off, size_t *len);
+void rcc_free(struct rcc_r *r);
+
+/* Append INDEX and TAIL to an unfinished container */
+int rcc_repair(const char *path, char *err, size_t errlen);
+
+#endif /* RCCAP_H */
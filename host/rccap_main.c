@@ -0,0 +1,557 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Record and read capture containers (see rccap.h).
+ *
+ *	rccap rec [-o file] [-c commands | -r file] [-s serial]
+ *	    [-M key=value] [-b stride] [-f flush-ms] [-F flush-bytes] [device]
+ *	rccap info [-v] file
+ *	rccap cat [-o offset] [-n length] file
+ *	rccap repair file
+ *
+ * rec reads the adapter (or stdin) until EOF or a signal.  The
+ * commands given with -c are sent first and recorded as metadata,
+ * the adapter's replies to them go to its UART, not to USB, so there
+ * is nothing to wait for.  The serial number is taken from the USB device
+ * where the system tells us, -s overrides.  A partial chunk is
+ * written out whenever the input pauses for flush-ms, so the file can
+ * be read while recording.
+ *
+ * The adapter numbers the bytes it sends, and holds the capture when
+ * the host goes away.  rec asks where the stream is and records that
+ * as "offset".  With -r, rec continues where the container file ends:
+ * the adapter sends the stream from that offset on, and the new
+ * container starts there, so the two together have no gap and no
+ * duplicates.  The adapter keeps 512 bytes back, if more was lost -r
+ * fails and the capture stays held.  So that this holds even if rec
+ * itself dies, -F writes data out every flush-bytes rather than every
+ * stride, 256 keeps it within what the adapter has.  Each chunk costs
+ * a 32 byte header and a 24 byte index entry, so that is about 20%
+ * more file, and it is off by default.
+ *
+ * info lists the metadata and checks every chunk, cat copies out a
+ * range of the stream, repair indexes a container whose recorder
+ * died before it could.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rccap.h"
+
+#define BUFSZ	65536
+
+static volatile sig_atomic_t stop;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: rccap rec [-o file] [-c commands | -r file] [-s serial]\n"
+	    "                 [-M key=value] [-b stride] [-f flush-ms]\n"
+	    "                 [-F flush-bytes] [device]\n"
+	    "       rccap info [-v] file\n"
+	    "       rccap cat [-o offset] [-n length] file\n"
+	    "       rccap repair file\n");
+	exit(2);
+}
+
+static void
+onsig(int sig)
+{
+
+	(void)sig;
+	stop = 1;
+}
+
+/* The iSerialNumber string of the USB device behind a tty */
+static int
+usb_serial(const char *dev, char *buf, size_t len)
+{
+#ifdef __linux__
+	char rp[PATH_MAX], fn[PATH_MAX + 64], *b;
+	FILE *f;
+
+	if (realpath(dev, rp) == NULL)
+		return (-1);
+	b = strrchr(rp, '/');
+	snprintf(fn, sizeof fn, "/sys/class/tty/%s/device/../serial",
+	    b != NULL ? b + 1 : rp);
+	f = fopen(fn, "r");
+	if (f == NULL)
+		return (-1);
+	if (fgets(buf, len, f) == NULL) {
+		fclose(f);
+		return (-1);
+	}
+	fclose(f);
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return (buf[0] != '\0' ? 0 : -1);
+#else
+	(void)dev;
+	(void)buf;
+	(void)len;
+	return (-1);
+#endif
+}
+
+static uint32_t
+le32(const uint8_t *p)
+{
+
+	return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+/*
+ * Send 'Z' and the offset, and read until the reply is in buf, adding
+ * to the *n bytes already there.  Return where the reply starts, or -1
+ * if none came.  "ESC Z off ~off" means the stream from off follows,
+ * "ESC z lo hi" that only lo...hi can be had.
+ */
+static long
+resume(int fd, uint32_t off, uint8_t *buf, size_t *n, uint32_t *lo,
+    uint32_t *hi)
+{
+	struct pollfd pfd;
+	uint8_t z[5];
+	size_t i = 0;
+	ssize_t j;
+
+	z[0] = 'Z';
+	z[1] = off;
+	z[2] = off >> 8;
+	z[3] = off >> 16;
+	z[4] = off >> 24;
+	if (write(fd, z, sizeof z) != sizeof z)
+		return (-1);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		for (; i + 10 <= *n; i++) {
+			if (buf[i] != 0x1b)
+				continue;
+			*lo = le32(buf + i + 2);
+			*hi = le32(buf + i + 6);
+			if (buf[i + 1] == 'Z' && *hi == ~*lo)
+				return (i);
+			if (buf[i + 1] == 'z' && *hi - *lo <= 4096)
+				return (i);
+		}
+		if (*n == BUFSZ || poll(&pfd, 1, 2000) != 1)
+			return (-1);
+		j = read(fd, buf + *n, BUFSZ - *n);
+		if (j <= 0)
+			return (-1);
+		*n += j;
+	}
+}
+
+static const char *
+modename(char c)
+{
+
+	switch (c) {
+	case 'b':	return ("binary");
+	case 'h':	return ("hex");
+	case 'd':	return ("dump16");
+	case 'D':	return ("dump32");
+	case 'e':	return ("base64");
+	default:	return (NULL);
+	}
+}
+
+static int
+do_rec(int argc, char **argv)
+{
+	struct rcc_w *w;
+	struct rcc_r *r;
+	struct termios tio;
+	struct pollfd pfd;
+	struct sigaction sa;
+	const char *out = NULL, *cmds = NULL, *serial = NULL, *mode = NULL;
+	const char *prev = NULL, *v, *meta[32];
+	char sbuf[128], hn[256], tbuf[32], err[128], *eq;
+	uint8_t *buf;
+	uint32_t stride = RCC_STRIDE, off = 0, lo, hi;
+	unsigned nmeta = 0, u;
+	size_t left = 0, unflushed = 0, flush_b = 0;
+	ssize_t n;
+	long at = -1;
+	int ch, in = 0, ofd = 1, flush_ms = 1000, tty = 0;
+
+	while ((ch = getopt(argc, argv, "b:c:F:f:M:o:r:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			stride = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cmds = optarg;
+			break;
+		case 'F':
+			flush_b = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			flush_ms = atoi(optarg);
+			break;
+		case 'M':
+			if (strchr(optarg, '=') == NULL || nmeta == 32)
+				usage();
+			meta[nmeta++] = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'r':
+			prev = optarg;
+			break;
+		case 's':
+			serial = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || stride == 0)
+		usage();
+
+	if (argc == 1) {
+		in = open(argv[0], O_RDWR | O_NOCTTY);
+		if (in < 0) {
+			perror(argv[0]);
+			return (2);
+		}
+		if (serial == NULL && usb_serial(argv[0], sbuf, sizeof sbuf) == 0)
+			serial = sbuf;
+	}
+	if (isatty(in) && tcgetattr(in, &tio) == 0) {
+		cfmakeraw(&tio);
+		(void)tcsetattr(in, TCSANOW, &tio);
+		tty = 1;
+	}
+	if ((cmds != NULL || prev != NULL) && !tty) {
+		fprintf(stderr, "rccap: -c and -r need the adapter as input\n");
+		return (2);
+	}
+	/* Any other command would make the adapter drop what it holds */
+	if (cmds != NULL && prev != NULL) {
+		fprintf(stderr, "rccap: -c and -r don't mix\n");
+		return (2);
+	}
+	if (prev != NULL) {
+		r = rcc_open(prev, err, sizeof err);
+		if (r == NULL) {
+			fprintf(stderr, "%s: %s\n", prev, err);
+			return (2);
+		}
+		v = rcc_meta_find(r, "offset");
+		if (v == NULL) {
+			fprintf(stderr, "%s: no offset recorded\n", prev);
+			return (2);
+		}
+		off = strtoul(v, NULL, 0) + rcc_size(r);
+		rcc_free(r);
+	}
+	if (out != NULL) {
+		ofd = open(out, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (ofd < 0) {
+			perror(out);
+			return (2);
+		}
+	} else if (isatty(ofd)) {
+		fprintf(stderr, "rccap: not writing a container to a tty\n");
+		return (2);
+	}
+	buf = malloc(BUFSZ);
+	if (buf == NULL) {
+		perror("malloc");
+		return (2);
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = onsig;
+	(void)sigaction(SIGINT, &sa, NULL);
+	(void)sigaction(SIGTERM, &sa, NULL);
+	(void)sigaction(SIGHUP, &sa, NULL);
+
+	if (cmds != NULL &&
+	    write(in, cmds, strlen(cmds)) != (ssize_t)strlen(cmds)) {
+		perror("rccap: commands");
+		goto fail;
+	}
+	for (u = 0; cmds != NULL && cmds[u] != '\0'; u++)
+		if (modename(cmds[u]) != NULL)
+			mode = modename(cmds[u]);
+
+	/*
+	 * What came before the reply to a resume was already had, what
+	 * came before the reply to the query is the stream up to hi.
+	 */
+	if (tty) {
+		at = resume(in, prev != NULL ? off : 0xffffffffU, buf, &left,
+		    &lo, &hi);
+		if (at >= 0 && buf[at + 1] == 'Z') {
+			left -= at + 10;
+			memmove(buf, buf + at + 10, left);
+		} else if (at >= 0 && prev == NULL) {
+			off = hi - at;
+			left -= 10;
+			memmove(buf + at, buf + at + 10, left - at);
+		} else if (at >= 0) {
+			fprintf(stderr, "rccap: offset %u is gone, "
+			    "the adapter has %u...%u\n", off, lo, hi);
+			goto fail;
+		} else if (prev != NULL) {
+			fprintf(stderr, "rccap: no reply to resume\n");
+			goto fail;
+		}
+	}
+
+	w = rcc_create(ofd, stride);
+	if (w == NULL) {
+		perror("rccap");
+		return (2);
+	}
+	(void)rcc_meta(w, "tool", "rccap");
+	if (gethostname(hn, sizeof hn) == 0) {
+		hn[sizeof hn - 1] = '\0';
+		(void)rcc_meta(w, "host", hn);
+	}
+	if (argc == 1)
+		(void)rcc_meta(w, "device", argv[0]);
+	if (serial != NULL)
+		(void)rcc_meta(w, "serial", serial);
+	if (cmds != NULL)
+		(void)rcc_meta(w, "commands", cmds);
+	if (mode != NULL)
+		(void)rcc_meta(w, "mode", mode);
+	if (at >= 0) {
+		snprintf(tbuf, sizeof tbuf, "%u", off);
+		(void)rcc_meta(w, "offset", tbuf);
+	}
+	if (prev != NULL)
+		(void)rcc_meta(w, "resumes", prev);
+	for (u = 0; u < nmeta; u++) {
+		eq = strchr(meta[u], '=');
+		*eq = '\0';
+		if (rcc_meta(w, meta[u], eq + 1)) {
+			fprintf(stderr, "rccap: bad metadata \"%s\"\n", meta[u]);
+			return (2);
+		}
+	}
+	if (left > 0 && rcc_write(w, buf, left))
+		goto bad;
+
+	pfd.fd = in;
+	pfd.events = POLLIN;
+	while (!stop) {
+		ch = poll(&pfd, 1, flush_ms);
+		if (ch < 0)
+			continue;		/* Signal, check stop */
+		if (ch == 0) {
+			if (rcc_flush(w))
+				goto bad;
+			unflushed = 0;
+			continue;
+		}
+		n = read(in, buf, BUFSZ);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("read");
+			break;
+		}
+		if (n == 0)
+			break;
+		if (rcc_write(w, buf, n))
+			goto bad;
+		unflushed += n;
+		if (flush_b > 0 && unflushed >= flush_b) {
+			if (rcc_flush(w))
+				goto bad;
+			unflushed = 0;
+		}
+	}
+	if (rcc_close(w))
+		goto bad;
+	free(buf);
+	return (0);
+
+    bad:
+	perror("rccap: write");
+	return (1);
+
+    fail:
+	if (out != NULL)
+		(void)unlink(out);
+	return (1);
+}
+
+static int
+do_info(int argc, char **argv)
+{
+	struct rcc_r *r;
+	const uint8_t *p;
+	const char *k, *v;
+	char err[128], tbuf[64];
+	uint64_t off;
+	uint32_t ms, crc = 0;
+	size_t len;
+	time_t t;
+	unsigned i, bad = 0;
+	int ch, verbose = 0;
+
+	while ((ch = getopt(argc, argv, "v")) != -1) {
+		switch (ch) {
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	r = rcc_open(argv[0], err, sizeof err);
+	if (r == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[0], err);
+		return (2);
+	}
+	t = rcc_start(r) / 1000000000ULL;
+	strftime(tbuf, sizeof tbuf, "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+	printf("start\t%sZ\n", tbuf);
+	for (i = 0; rcc_meta_get(r, i, &k, &v) == 0; i++)
+		printf("%s\t%s\n", k, v);
+	for (i = 0; i < rcc_nchunks(r); i++) {
+		p = rcc_chunk(r, i, &off, &len, &ms);
+		crc = rcc_crc32(crc, p, len);
+		if (!rcc_verify(r, i)) {
+			printf("chunk %u at %ju: BAD\n", i, (uintmax_t)off);
+			bad++;
+		} else if (verbose)
+			printf("chunk %u at %ju: %zu bytes, %u ms\n",
+			    i, (uintmax_t)off, len, ms);
+	}
+	printf("bytes\t%ju\nchunks\t%u\ncrc32\t%08x\nindexed\t%s\n",
+	    (uintmax_t)rcc_size(r), rcc_nchunks(r), crc,
+	    rcc_indexed(r) ? "yes" : "no (try rccap repair)");
+	if (rcc_indexed(r) && crc != rcc_crc(r)) {
+		printf("crc32 BAD, the index says %08x\n", rcc_crc(r));
+		bad++;
+	}
+	rcc_free(r);
+	return (bad > 0);
+}
+
+static int
+do_cat(int argc, char **argv)
+{
+	struct rcc_r *r;
+	const uint8_t *p;
+	char err[128];
+	uint64_t off = 0, n = UINT64_MAX;
+	size_t len;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:o:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			off = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	r = rcc_open(argv[0], err, sizeof err);
+	if (r == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[0], err);
+		return (2);
+	}
+	while (n > 0 && (p = rcc_at(r, off, &len)) != NULL) {
+		if (len > n)
+			len = n;
+		if (fwrite(p, 1, len, stdout) != len) {
+			perror("stdout");
+			return (2);
+		}
+		off += len;
+		n -= len;
+	}
+	rcc_free(r);
+	return (fflush(stdout) ? 2 : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	char err[128];
+
+	if (argc < 2)
+		usage();
+	argc--;
+	argv++;
+	if (!strcmp(argv[0], "rec"))
+		return (do_rec(argc, argv));
+	if (!strcmp(argv[0], "info"))
+		return (do_info(argc, argv));
+	if (!strcmp(argv[0], "cat"))
+		return (do_cat(argc, argv));
+	if (!strcmp(argv[0], "repair") && argc == 2) {
+		if (rcc_repair(argv[1], err, sizeof err)) {
+			fprintf(stderr, "%s: %s\n", argv[1], err);
+			return (1);
+		}
+		return (0);
+	}
+	usage();
+	return (2);
+}
@@ -0,0 +1,340 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Hex stream decoder, see rcdec.h
+ *
+ * The stream is a sequence of four byte records, so the vector paths
+ * load 4 (SSE2) or 8 (AVX2) records at a time, validate all the bytes
+ * at once and squeeze the nibble pairs down to bytes.  Anything which
+ * does not check out goes back to the scalar code which knows how to
+ * count it and resynchronize.
+ */
+
+#include <string.h>
+
+#include "rcdec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RCDEC_X86	1
+#include <immintrin.h>
+#else
+#define RCDEC_X86	0
+#endif
+
+static int8_t hexval[256];
+
+static void
+rcdec_tbl(void)
+{
+	int i;
+
+	if (hexval[0] == -1)
+		return;
+	for (i = 0; i < 256; i++)
+		hexval[i] = -1;
+	for (i = 0; i < 10; i++)
+		hexval['0' + i] = i;
+	for (i = 0; i < 6; i++) {
+		hexval['a' + i] = 10 + i;
+		hexval['A' + i] = 10 + i;
+	}
+}
+
+/* One record, -1 if malformed */
+static inline int
+rcdec_rec(const uint8_t *p)
+{
+	int h, l;
+
+	if (p[2] != '\r' || p[3] != '\n')
+		return (-1);
+	h = hexval[p[0]];
+	l = hexval[p[1]];
+	if ((h | l) < 0)
+		return (-1);
+	return (h << 4 | l);
+}
+
+/*
+ * Block decoders:  decode up to nrec records from in, stop at the
+ * first malformed one and return the number decoded.  They may write
+ * garbage into out beyond the returned count, but never beyond nrec.
+ */
+
+static size_t
+rcdec_scalar(const uint8_t *in, size_t nrec, uint8_t *out)
+{
+	size_t i;
+	int c;
+
+	for (i = 0; i < nrec; i++, in += 4) {
+		c = rcdec_rec(in);
+		if (c < 0)
+			break;
+		out[i] = c;
+	}
+	return (i);
+}
+
+#if RCDEC_X86
+
+__attribute__((target("sse2")))
+static size_t
+rcdec_sse2(const uint8_t *in, size_t nrec, uint8_t *out)
+{
+	const __m128i crlf = _mm_set1_epi32(0x0a0d0000);
+	const __m128i lo09 = _mm_set1_epi8('0' - 1);
+	const __m128i hi09 = _mm_set1_epi8('9' + 1);
+	const __m128i loaf = _mm_set1_epi8('a' - 1);
+	const __m128i hiaf = _mm_set1_epi8('f' + 1);
+	const __m128i x20 = _mm_set1_epi8(0x20);
+	const __m128i x0f = _mm_set1_epi8(0x0f);
+	const __m128i x09 = _mm_set1_epi8(9);
+	const __m128i xff = _mm_set1_epi32(0xff);
+	__m128i v, w, dig, alp, nib;
+	unsigned m;
+	uint32_t u;
+	size_t i;
+
+	for (i = 0; i + 4 <= nrec; i += 4, in += 16) {
+		v = _mm_loadu_si128((const __m128i *)in);
+		dig = _mm_and_si128(_mm_cmpgt_epi8(v, lo09),
+		    _mm_cmplt_epi8(v, hi09));
+		w = _mm_or_si128(v, x20);
+		alp = _mm_and_si128(_mm_cmpgt_epi8(w, loaf),
+		    _mm_cmplt_epi8(w, hiaf));
+		m = (_mm_movemask_epi8(_mm_or_si128(dig, alp)) & 0x3333) |
+		    (_mm_movemask_epi8(_mm_cmpeq_epi8(v, crlf)) & 0xcccc);
+
+		nib = _mm_add_epi8(_mm_and_si128(v, x0f),
+		    _mm_and_si128(alp, x09));
+		w = _mm_or_si128(_mm_slli_epi16(nib, 4), _mm_srli_epi16(nib, 8));
+		w = _mm_and_si128(w, xff);
+		w = _mm_packs_epi32(w, w);
+		w = _mm_packus_epi16(w, w);
+		u = (uint32_t)_mm_cvtsi128_si32(w);
+		memcpy(out + i, &u, 4);
+
+		if (m != 0xffff)
+			return (i + __builtin_ctz(~m) / 4);
+	}
+	return (i + rcdec_scalar(in, nrec - i, out + i));
+}
+
+__attribute__((target("avx2")))
+static size_t
+rcdec_avx2(const uint8_t *in, size_t nrec, uint8_t *out)
+{
+	const __m256i crlf = _mm256_set1_epi32(0x0a0d0000);
+	const __m256i lo09 = _mm256_set1_epi8('0' - 1);
+	const __m256i hi09 = _mm256_set1_epi8('9' + 1);
+	const __m256i loaf = _mm256_set1_epi8('a' - 1);
+	const __m256i hiaf = _mm256_set1_epi8('f' + 1);
+	const __m256i x20 = _mm256_set1_epi8(0x20);
+	const __m256i x0f = _mm256_set1_epi8(0x0f);
+	const __m256i x09 = _mm256_set1_epi8(9);
+	const __m256i gather = _mm256_setr_epi8(
+	    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	__m256i v, w, dig, alp, nib;
+	uint32_t m, u[2];
+	size_t i;
+
+	for (i = 0; i + 8 <= nrec; i += 8, in += 32) {
+		v = _mm256_loadu_si256((const __m256i *)in);
+		dig = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo09),
+		    _mm256_cmpgt_epi8(hi09, v));
+		w = _mm256_or_si256(v, x20);
+		alp = _mm256_and_si256(_mm256_cmpgt_epi8(w, loaf),
+		    _mm256_cmpgt_epi8(hiaf, w));
+		m = ((uint32_t)_mm256_movemask_epi8(
+		    _mm256_or_si256(dig, alp)) & 0x33333333) |
+		    ((uint32_t)_mm256_movemask_epi8(
+		    _mm256_cmpeq_epi8(v, crlf)) & 0xcccccccc);
+
+		nib = _mm256_add_epi8(_mm256_and_si256(v, x0f),
+		    _mm256_and_si256(alp, x09));
+		w = _mm256_or_si256(_mm256_slli_epi16(nib, 4),
+		    _mm256_srli_epi16(nib, 8));
+		w = _mm256_shuffle_epi8(w, gather);
+		u[0] = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(w));
+		u[1] = (uint32_t)_mm_cvtsi128_si32(
+		    _mm256_extracti128_si256(w, 1));
+		memcpy(out + i, u, 8);
+
+		if (m != 0xffffffff)
+			return (i + __builtin_ctz(~m) / 4);
+	}
+	return (i + rcdec_sse2(in, nrec - i, out + i));
+}
+
+#endif /* RCDEC_X86 */
+
+int
+rcdec_impl(struct rcdec *d, int impl)
+{
+
+#if RCDEC_X86
+	__builtin_cpu_init();
+	if (impl == RCDEC_BEST)
+		impl = __builtin_cpu_supports("avx2") ? RCDEC_AVX2 :
+		    __builtin_cpu_supports("sse2") ? RCDEC_SSE2 : RCDEC_SCALAR;
+	if (impl == RCDEC_AVX2 && __builtin_cpu_supports("avx2")) {
+		d->block = rcdec_avx2;
+		d->impl = "avx2";
+		return (0);
+	}
+	if (impl == RCDEC_SSE2 && __builtin_cpu_supports("sse2")) {
+		d->block = rcdec_sse2;
+		d->impl = "sse2";
+		return (0);
+	}
+#else
+	if (impl == RCDEC_BEST)
+		impl = RCDEC_SCALAR;
+#endif
+	if (impl == RCDEC_SCALAR) {
+		d->block = rcdec_scalar;
+		d->impl = "scalar";
+		return (0);
+	}
+	return (-1);
+}
+
+int
+rcdec_init(struct rcdec *d, int mode)
+{
+
+	if (mode != RCDEC_BIN && mode != RCDEC_HEX)
+		return (-1);
+	rcdec_tbl();
+	memset(d, 0, sizeof *d);
+	d->mode = mode;
+	return (rcdec_impl(d, RCDEC_BEST));
+}
+
+/*
+ * Decode what we can of p[0...n), leave at most three bytes of a
+ * partial record and return the number of bytes consumed.
+ */
+static size_t
+rcdec_run(struct rcdec *d, const uint8_t *p, size_t n, uint8_t **op)
+{
+	const uint8_t *p0 = p, *e = p + n, *q;
+	uint8_t *o = *op;
+	size_t nrec, m;
+	int c;
+
+	while (p < e) {
+		if (d->skip) {
+			q = memchr(p, '\n', e - p);
+			if (q == NULL) {
+				p = e;
+				break;
+			}
+			p = q + 1;
+			d->skip = 0;
+			continue;
+		}
+		nrec = (e - p) / 4;
+		if (nrec == 0)
+			break;
+		m = d->block(p, nrec, o);
+		p += 4 * m;
+		o += m;
+		if (m == nrec)
+			continue;
+		c = rcdec_rec(p);
+		if (c >= 0) {
+			/* Block decoder was conservative */
+			*o++ = c;
+			p += 4;
+		} else {
+			d->nbad++;
+			d->skip = 1;
+		}
+	}
+	*op = o;
+	return (p - p0);
+}
+
+size_t
+rcdec_feed(struct rcdec *d, const uint8_t *in, size_t len, uint8_t *out)
+{
+	uint8_t scratch[64], *o = out;
+	size_t n, k;
+
+	d->nin += len;
+	if (d->mode == RCDEC_BIN) {
+		memcpy(out, in, len);
+		d->nout += len;
+		return (len);
+	}
+
+	if (d->ncarry > 0) {
+		/*
+		 * Finish the split record in a scratch buffer, together
+		 * with the head of the new input so a bad record can
+		 * resynchronize into it.
+		 */
+		k = d->ncarry;
+		n = len < sizeof scratch - k ? len : sizeof scratch - k;
+		memcpy(scratch, d->carry, k);
+		memcpy(scratch + k, in, n);
+		n = rcdec_run(d, scratch, k + n, &o);
+		if (n < k) {
+			/* Not even the carried record completed */
+			d->ncarry = k + len - n;
+			memmove(d->carry, scratch + n, d->ncarry);
+			d->nout += o - out;
+			return (o - out);
+		}
+		in += n - k;
+		len -= n - k;
+		d->ncarry = 0;
+	}
+
+	n = rcdec_run(d, in, len, &o);
+	d->ncarry = len - n;
+	memcpy(d->carry, in + n, d->ncarry);
+	d->nout += o - out;
+	return (o - out);
+}
+
+void
+rcdec_finish(struct rcdec *d)
+{
+
+	/* A partial record at the end of the stream */
+	if (d->ncarry > 0 && !d->skip)
+		d->nbad++;
+	d->ncarry = 0;
+	d->skip = 0;
+}
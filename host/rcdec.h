@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Decoder for the capture stream of the RC-2000 USB adapter.
+ *
+ * Hex mode ('h') sends every character as "xx\r\n", binary mode ('b')
+ * sends the bytes as they are.  The hex decoder takes any chunking of
+ * the stream, validates every record and resynchronizes on the next
+ * '\n' after a malformed one, so text replies from the adapter ("job
+ * done, ..." and the like) are counted and skipped.
+ *
+ *	struct rcdec d;
+ *
+ *	rcdec_init(&d, RCDEC_HEX);
+ *	while ((n = read(fd, in, sizeof in)) > 0) {
+ *		m = rcdec_feed(&d, in, n, out);	// out: RCDEC_OUTSZ(n)
+ *		write(1, out, m);
+ *	}
+ *	rcdec_finish(&d);
+ */
+
+#ifndef RCDEC_H
+#define RCDEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RCDEC_BIN	0
+#define RCDEC_HEX	1
+
+/* Implementations of the hex decoder, RCDEC_BEST picks at runtime */
+#define RCDEC_BEST	0
+#define RCDEC_SCALAR	1
+#define RCDEC_SSE2	2
+#define RCDEC_AVX2	3
+
+/* Output can never be larger than the input */
+#define RCDEC_OUTSZ(n)	(n)
+
+typedef size_t rcdec_block_f(const uint8_t *in, size_t nrec, uint8_t *out);
+
+struct rcdec {
+	int		mode;
+	int		skip;		/* Resyncing, drop until '\n' */
+	unsigned	ncarry;
+	uint8_t		carry[4];	/* Record split across feeds */
+	rcdec_block_f	*block;
+	const char	*impl;
+
+	uint64_t	nin;		/* Bytes fed */
+	uint64_t	nout;		/* Bytes decoded */
+	uint64_t	nbad;		/* Malformed records skipped */
+};
+
+int rcdec_init(struct rcdec *d, int mode);
+int rcdec_impl(struct rcdec *d, int impl);
+size_t rcdec_feed(struct rcdec *d, const uint8_t *in, size_t len,
+    uint8_t *out);
+void rcdec_finish(struct rcdec *d);
+
+#endif /* RCDEC_H */
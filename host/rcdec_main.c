@@ -0,0 +1,135 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Decode a capture from the RC-2000 adapter into the raw tape bytes.
+ *
+ *	rcdec [-b | -x] [-s scalar|sse2|avx2] [-q] [file]
+ *
+ * -x (the default) takes the hex mode stream, -b a binary mode one.
+ * The decoded bytes go to stdout, the counts to stderr.  The exit
+ * status is 1 if malformed records were skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rcdec.h"
+
+#define BUFSZ	(1 << 20)
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: rcdec [-b | -x] [-s scalar|sse2|avx2] [-q] [file]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct rcdec d;
+	FILE *f = stdin;
+	uint8_t *in, *out;
+	size_t n, m;
+	int ch, mode = RCDEC_HEX, impl = RCDEC_BEST, quiet = 0;
+
+	while ((ch = getopt(argc, argv, "bqs:x")) != -1) {
+		switch (ch) {
+		case 'b':
+			mode = RCDEC_BIN;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 's':
+			if (!strcmp(optarg, "scalar"))
+				impl = RCDEC_SCALAR;
+			else if (!strcmp(optarg, "sse2"))
+				impl = RCDEC_SSE2;
+			else if (!strcmp(optarg, "avx2"))
+				impl = RCDEC_AVX2;
+			else
+				usage();
+			break;
+		case 'x':
+			mode = RCDEC_HEX;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+	if (argc == 1) {
+		f = fopen(argv[0], "rb");
+		if (f == NULL) {
+			perror(argv[0]);
+			exit(2);
+		}
+	}
+
+	(void)rcdec_init(&d, mode);
+	if (rcdec_impl(&d, impl)) {
+		fprintf(stderr, "rcdec: implementation not supported here\n");
+		exit(2);
+	}
+	in = malloc(BUFSZ);
+	out = malloc(RCDEC_OUTSZ(BUFSZ));
+	if (in == NULL || out == NULL) {
+		perror("malloc");
+		exit(2);
+	}
+	while ((n = fread(in, 1, BUFSZ, f)) > 0) {
+		m = rcdec_feed(&d, in, n, out);
+		if (m > 0 && fwrite(out, 1, m, stdout) != m) {
+			perror("stdout");
+			exit(2);
+		}
+	}
+	if (ferror(f)) {
+		perror("read");
+		exit(2);
+	}
+	rcdec_finish(&d);
+	if (fflush(stdout)) {
+		perror("stdout");
+		exit(2);
+	}
+	if (!quiet)
+		fprintf(stderr, "%ju in, %ju out, %ju bad (%s)\n",
+		    (uintmax_t)d.nin, (uintmax_t)d.nout, (uintmax_t)d.nbad,
+		    mode == RCDEC_HEX ? d.impl : "binary");
+	exit(d.nbad > 0);
+}
@@ -0,0 +1,562 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Paper tape character code transcoder, see rctr.h
+ *
+ * Runs of plain characters go through a table lookup which the vector
+ * paths do 16 or 32 bytes at a time, splitting every byte in nibbles
+ * and using PSHUFB on one 16 byte slice of the table per high nibble.
+ * Codes with fewer channels need fewer slices:  five track codes do
+ * with two, seven bit ASCII with eight, the parity channel is checked
+ * separately with a PSHUFB on a nibble parity table.  Whatever the
+ * table has no plain character for stops the vector loop and takes
+ * the scalar way through the state machine.
+ *
+ * With 16 byte vectors the slices soon cost more than the scalar
+ * lookup saves:  SSSE3 beats scalar by 2.8x on ITA2 but is slower on
+ * ASCII, so RCTR_BEST only picks it for up to SSSE3_SLICES.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rctr.h"
+
+#define SSSE3_SLICES	4
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RCTR_X86	1
+#include <immintrin.h>
+#else
+#define RCTR_X86	0
+#endif
+
+/* Uncompiled code, indexed by the data channels only */
+struct rctr_def {
+	uint8_t		out[RCTR_NSTATE][256];
+	uint8_t		shift[256];	/* state + 1 */
+	uint8_t		skip[256];
+};
+
+/* ITA2 and US TTY, zero for codes without a printing character */
+static const char ita2_ltrs[32] =
+    "\0E\nA SIU\rDRJNFCKTZLWHYPQOBG\0MXV\0";
+static const char ita2_figs[32] =
+    "\0" "3\n- '87\r" "\005" "4\a,\0:(5+)2\0" "6019?\0\0./=\0";
+static const char ustty_figs[32] =
+    "\0" "3\n- \a87\r$4',!:(5\")2#6019?&\0./;\0";
+
+static const char *builtin[] = {
+	"ascii", "ascii-even", "ascii-odd", "ita2", "ustty", NULL
+};
+
+static void
+rctr_compile(struct rctr_code *c, const struct rctr_def *d)
+{
+	unsigned b, v, p, s;
+
+	c->vmask = c->mask;
+	/* Round up to whole channels from 1 so the lookup can mask */
+	c->vmask |= c->vmask >> 1;
+	c->vmask |= c->vmask >> 2;
+	c->vmask |= c->vmask >> 4;
+	for (s = 0; s < (unsigned)c->nstate; s++) {
+		for (b = 0; b < 256; b++) {
+			v = b & c->mask;
+			p = __builtin_popcount(b & c->pmask) & 1;
+			c->lut[s][b] = 0;
+			if (d->skip[v])
+				c->act[s][b] = RCTR_SKIP;
+			else if (d->shift[v])
+				c->act[s][b] = RCTR_SHIFT | (d->shift[v] - 1);
+			else if (d->out[s][v]) {
+				c->lut[s][b] = d->out[s][v];
+				c->act[s][b] = 0;
+			} else
+				c->act[s][b] = RCTR_BAD;
+			/* Leader and rubouts are skipped whatever the parity */
+			if (c->pmask && p != c->podd &&
+			    c->act[s][b] != RCTR_SKIP)
+				c->act[s][b] = RCTR_BAD;
+			c->map[s][b] = c->act[s][b] == 0 ? c->lut[s][b] : 0;
+		}
+	}
+	/* The states nobody named */
+	for (; s < RCTR_NSTATE; s++) {
+		memset(c->map[s], 0, sizeof c->map[s]);
+		memset(c->lut[s], 0, sizeof c->lut[s]);
+		memset(c->act[s], RCTR_BAD, sizeof c->act[s]);
+	}
+}
+
+const char *
+rctr_list(int idx)
+{
+
+	if (idx < 0 || idx >= (int)(sizeof builtin / sizeof builtin[0]))
+		return (NULL);
+	return (builtin[idx]);
+}
+
+int
+rctr_builtin(struct rctr_code *c, const char *name)
+{
+	struct rctr_def d;
+	const char *figs;
+	unsigned u;
+
+	memset(c, 0, sizeof *c);
+	memset(&d, 0, sizeof d);
+	if (!strncmp(name, "ascii", 5)) {
+		/* Blank tape and rubout are skipped */
+		c->mask = 0x7f;
+		if (!strcmp(name + 5, "-even"))
+			c->pmask = 0xff;
+		else if (!strcmp(name + 5, "-odd")) {
+			c->pmask = 0xff;
+			c->podd = 1;
+		} else if (name[5] != '\0')
+			return (-1);
+		c->nstate = 1;
+		strcpy(c->sname[0], "ascii");
+		for (u = 1; u < 0x7f; u++)
+			d.out[0][u] = u;
+		d.skip[0x00] = d.skip[0x7f] = 1;
+	} else if (!strcmp(name, "ita2") || !strcmp(name, "ustty")) {
+		figs = name[0] == 'i' ? ita2_figs : ustty_figs;
+		c->mask = 0x1f;
+		c->nstate = 2;
+		strcpy(c->sname[0], "ltrs");
+		strcpy(c->sname[1], "figs");
+		for (u = 0; u < 32; u++) {
+			d.out[0][u] = ita2_ltrs[u];
+			d.out[1][u] = figs[u];
+		}
+		d.skip[0x00] = 1;
+		d.shift[0x1f] = 1;
+		d.shift[0x1b] = 2;
+	} else
+		return (-1);
+	strcpy(c->name, name);
+	rctr_compile(c, &d);
+	return (0);
+}
+
+static int
+rctr_num(const char *s, unsigned max, unsigned *v)
+{
+	char *e;
+	unsigned long ul;
+
+	ul = strtoul(s, &e, 0);
+	if (*s == '\0' || *e != '\0' || ul > max)
+		return (-1);
+	*v = ul;
+	return (0);
+}
+
+static int
+rctr_char(const char *s, unsigned *v)
+{
+	static const char esc[] = "n\nr\rt\ta\ab\bf\f";
+	const char *p;
+
+	if (s[0] != '\0' && s[1] == '\0') {
+		*v = (uint8_t)s[0];
+		return (0);
+	}
+	if (!strcmp(s, "sp")) {
+		*v = ' ';
+		return (0);
+	}
+	if (s[0] == '\\' && s[1] != '\0' && s[2] == '\0') {
+		for (p = esc; *p != '\0'; p += 2) {
+			if (*p == s[1]) {
+				*v = (uint8_t)p[1];
+				return (0);
+			}
+		}
+		return (-1);
+	}
+	if (rctr_num(s, 255, v) || *v == 0)
+		return (-1);
+	return (0);
+}
+
+static int
+rctr_state(struct rctr_code *c, const char *name)
+{
+	int s;
+
+	for (s = 0; s < c->nstate; s++)
+		if (!strcmp(c->sname[s], name))
+			return (s);
+	if (c->nstate == RCTR_NSTATE || strlen(name) >= sizeof c->sname[0])
+		return (-1);
+	strcpy(c->sname[c->nstate], name);
+	return (c->nstate++);
+}
+
+int
+rctr_parse(struct rctr_code *c, const char *text, char *err, size_t errlen)
+{
+	struct rctr_def d;
+	char buf[256], *tok[8], *p, *sp;
+	const char *nl;
+	uint8_t tmp[256];
+	unsigned ln, ntok, v, o;
+	int cur = -1, init = -1, s;
+	size_t l;
+
+	memset(c, 0, sizeof *c);
+	memset(&d, 0, sizeof d);
+	c->mask = 0xff;
+	for (ln = 1; *text != '\0'; ln++, text = nl) {
+		nl = strchr(text, '\n');
+		l = nl != NULL ? (size_t)(nl - text) : strlen(text);
+		nl = nl != NULL ? nl + 1 : text + l;
+		if (l >= sizeof buf) {
+			snprintf(err, errlen, "line %u: too long", ln);
+			return (-1);
+		}
+		memcpy(buf, text, l);
+		buf[l] = '\0';
+
+		/* '#' starts a comment unless it is an output character */
+		for (ntok = 0, p = strtok_r(buf, " \t\r", &sp); p != NULL;
+		    p = strtok_r(NULL, " \t\r", &sp)) {
+			if (*p == '#' && ntok != 1)
+				break;
+			if (ntok == 8)
+				break;
+			tok[ntok++] = p;
+		}
+		if (ntok == 0)
+			continue;
+
+		if (!strcmp(tok[0], "name") && ntok == 2) {
+			snprintf(c->name, sizeof c->name, "%s", tok[1]);
+		} else if (!strcmp(tok[0], "mask") && ntok == 2) {
+			if (rctr_num(tok[1], 255, &v) || v == 0)
+				goto bad;
+			c->mask = v;
+		} else if (!strcmp(tok[0], "parity") && ntok == 3) {
+			if (rctr_num(tok[2], 255, &v) || v == 0)
+				goto bad;
+			c->pmask = v;
+			if (!strcmp(tok[1], "odd"))
+				c->podd = 1;
+			else if (strcmp(tok[1], "even"))
+				goto bad;
+		} else if (!strcmp(tok[0], "state") && ntok == 2) {
+			cur = rctr_state(c, tok[1]);
+			if (cur < 0)
+				goto bad;
+			if (init < 0)
+				init = cur;
+		} else if (!strcmp(tok[0], "shift") && ntok == 3) {
+			s = rctr_state(c, tok[2]);
+			if (s < 0 || rctr_num(tok[1], 255, &v))
+				goto bad;
+			d.shift[v & c->mask] = s + 1;
+		} else if (!strcmp(tok[0], "skip") && ntok >= 2) {
+			for (o = 1; o < ntok; o++) {
+				if (rctr_num(tok[o], 255, &v))
+					goto bad;
+				d.skip[v & c->mask] = 1;
+			}
+		} else if (ntok == 2 && !rctr_num(tok[0], 255, &v)) {
+			if (cur < 0) {
+				snprintf(err, errlen, "line %u: no state", ln);
+				return (-1);
+			}
+			if (rctr_char(tok[1], &o))
+				goto bad;
+			d.out[cur][v & c->mask] = o;
+		} else
+			goto bad;
+	}
+	if (init < 0) {
+		snprintf(err, errlen, "no states");
+		return (-1);
+	}
+	if (init > 0) {
+		/* A shift named another state first, swap it to the front */
+		memcpy(tmp, c->sname[0], sizeof c->sname[0]);
+		memcpy(c->sname[0], c->sname[init], sizeof c->sname[0]);
+		memcpy(c->sname[init], tmp, sizeof c->sname[0]);
+		memcpy(tmp, d.out[0], sizeof tmp);
+		memcpy(d.out[0], d.out[init], sizeof tmp);
+		memcpy(d.out[init], tmp, sizeof tmp);
+		for (v = 0; v < 256; v++) {
+			if (d.shift[v] == 1)
+				d.shift[v] = init + 1;
+			else if (d.shift[v] == init + 1)
+				d.shift[v] = 1;
+		}
+	}
+	if (c->name[0] == '\0')
+		strcpy(c->name, "table");
+	rctr_compile(c, &d);
+	return (0);
+
+    bad:
+	snprintf(err, errlen, "line %u: cannot parse", ln);
+	return (-1);
+}
+
+int
+rctr_load(struct rctr_code *c, FILE *f, char *err, size_t errlen)
+{
+	char *text;
+	size_t n, sz = 1 << 16;
+	int r;
+
+	text = malloc(sz + 1);
+	if (text == NULL) {
+		snprintf(err, errlen, "out of memory");
+		return (-1);
+	}
+	n = fread(text, 1, sz, f);
+	if (ferror(f) || n == sz) {
+		snprintf(err, errlen, ferror(f) ? "read error" : "too big");
+		free(text);
+		return (-1);
+	}
+	text[n] = '\0';
+	r = rctr_parse(c, text, err, errlen);
+	free(text);
+	return (r);
+}
+
+/*
+ * Block lookups:  translate bytes from in while map[] has a plain
+ * character for them, return how many.  The vector ones may write
+ * garbage into out beyond that, but not beyond len.
+ */
+
+static size_t
+rctr_scalar(const struct rctr_code *c, int state, const uint8_t *in,
+    size_t len, uint8_t *out)
+{
+	const uint8_t *map = c->map[state];
+	size_t i;
+	uint8_t o;
+
+	for (i = 0; i < len; i++) {
+		o = map[in[i]];
+		if (o == 0)
+			break;
+		out[i] = o;
+	}
+	return (i);
+}
+
+#if RCTR_X86
+
+__attribute__((target("ssse3")))
+static size_t
+rctr_ssse3(const struct rctr_code *c, int state, const uint8_t *in,
+    size_t len, uint8_t *out)
+{
+	const uint8_t *map = c->lut[state];
+	const __m128i x0f = _mm_set1_epi8(0x0f);
+	const __m128i vm = _mm_set1_epi8(c->vmask);
+	const __m128i pm = _mm_set1_epi8(c->pmask);
+	const __m128i po = _mm_set1_epi8(c->podd);
+	const __m128i ptbl = _mm_setr_epi8(0, 1, 1, 0, 1, 0, 0, 1,
+	    1, 0, 0, 1, 0, 1, 1, 0);
+	__m128i tbl[16], u, v, lo, hi, r;
+	unsigned h, nh = (c->vmask >> 4) + 1, m;
+	size_t i;
+
+	for (h = 0; h < nh; h++)
+		tbl[h] = _mm_loadu_si128((const __m128i *)(map + 16 * h));
+	for (i = 0; i + 16 <= len; i += 16) {
+		u = _mm_loadu_si128((const __m128i *)(in + i));
+		v = _mm_and_si128(u, vm);
+		lo = _mm_and_si128(v, x0f);
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), x0f);
+		r = _mm_shuffle_epi8(tbl[0], lo);
+		if (nh > 1)
+			r = _mm_and_si128(r,
+			    _mm_cmpeq_epi8(hi, _mm_setzero_si128()));
+		for (h = 1; h < nh; h++)
+			r = _mm_or_si128(r, _mm_and_si128(
+			    _mm_shuffle_epi8(tbl[h], lo),
+			    _mm_cmpeq_epi8(hi, _mm_set1_epi8(h))));
+		if (c->pmask) {
+			u = _mm_and_si128(u, pm);
+			u = _mm_and_si128(_mm_xor_si128(u,
+			    _mm_srli_epi16(u, 4)), x0f);
+			r = _mm_and_si128(r, _mm_cmpeq_epi8(
+			    _mm_shuffle_epi8(ptbl, u), po));
+		}
+		_mm_storeu_si128((__m128i *)(out + i), r);
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(r, _mm_setzero_si128()));
+		if (m != 0)
+			return (i + __builtin_ctz(m));
+	}
+	return (i + rctr_scalar(c, state, in + i, len - i, out + i));
+}
+
+__attribute__((target("avx2")))
+static size_t
+rctr_avx2(const struct rctr_code *c, int state, const uint8_t *in,
+    size_t len, uint8_t *out)
+{
+	const uint8_t *map = c->lut[state];
+	const __m256i x0f = _mm256_set1_epi8(0x0f);
+	const __m256i vm = _mm256_set1_epi8(c->vmask);
+	const __m256i pm = _mm256_set1_epi8(c->pmask);
+	const __m256i po = _mm256_set1_epi8(c->podd);
+	const __m256i ptbl = _mm256_setr_epi8(0, 1, 1, 0, 1, 0, 0, 1,
+	    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+	    1, 0, 0, 1, 0, 1, 1, 0);
+	__m256i tbl[16], u, v, lo, hi, r;
+	unsigned h, nh = (c->vmask >> 4) + 1, m;
+	size_t i;
+
+	for (h = 0; h < nh; h++)
+		tbl[h] = _mm256_broadcastsi128_si256(
+		    _mm_loadu_si128((const __m128i *)(map + 16 * h)));
+	for (i = 0; i + 32 <= len; i += 32) {
+		u = _mm256_loadu_si256((const __m256i *)(in + i));
+		v = _mm256_and_si256(u, vm);
+		lo = _mm256_and_si256(v, x0f);
+		hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), x0f);
+		r = _mm256_shuffle_epi8(tbl[0], lo);
+		if (nh > 1)
+			r = _mm256_and_si256(r,
+			    _mm256_cmpeq_epi8(hi, _mm256_setzero_si256()));
+		for (h = 1; h < nh; h++)
+			r = _mm256_or_si256(r, _mm256_and_si256(
+			    _mm256_shuffle_epi8(tbl[h], lo),
+			    _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(h))));
+		if (c->pmask) {
+			u = _mm256_and_si256(u, pm);
+			u = _mm256_and_si256(_mm256_xor_si256(u,
+			    _mm256_srli_epi16(u, 4)), x0f);
+			r = _mm256_and_si256(r, _mm256_cmpeq_epi8(
+			    _mm256_shuffle_epi8(ptbl, u), po));
+		}
+		_mm256_storeu_si256((__m256i *)(out + i), r);
+		m = _mm256_movemask_epi8(
+		    _mm256_cmpeq_epi8(r, _mm256_setzero_si256()));
+		if (m != 0)
+			return (i + __builtin_ctz(m));
+	}
+	return (i + rctr_ssse3(c, state, in + i, len - i, out + i));
+}
+
+#endif /* RCTR_X86 */
+
+int
+rctr_impl(struct rctr *t, int impl)
+{
+
+#if RCTR_X86
+	__builtin_cpu_init();
+	if (impl == RCTR_BEST)
+		impl = __builtin_cpu_supports("avx2") ? RCTR_AVX2 :
+		    __builtin_cpu_supports("ssse3") &&
+		    (t->code->vmask >> 4) < SSSE3_SLICES ? RCTR_SSSE3 :
+		    RCTR_SCALAR;
+	if (impl == RCTR_AVX2 && __builtin_cpu_supports("avx2")) {
+		t->block = rctr_avx2;
+		t->impl = "avx2";
+		return (0);
+	}
+	if (impl == RCTR_SSSE3 && __builtin_cpu_supports("ssse3")) {
+		t->block = rctr_ssse3;
+		t->impl = "ssse3";
+		return (0);
+	}
+#else
+	if (impl == RCTR_BEST)
+		impl = RCTR_SCALAR;
+#endif
+	if (impl == RCTR_SCALAR) {
+		t->block = rctr_scalar;
+		t->impl = "scalar";
+		return (0);
+	}
+	return (-1);
+}
+
+void
+rctr_init(struct rctr *t, const struct rctr_code *c)
+{
+
+	memset(t, 0, sizeof *t);
+	t->code = c;
+	t->subst = '?';
+	(void)rctr_impl(t, RCTR_BEST);
+}
+
+size_t
+rctr_feed(struct rctr *t, const uint8_t *in, size_t len, uint8_t *out)
+{
+	const struct rctr_code *c = t->code;
+	const uint8_t *p = in, *e = in + len;
+	uint8_t *o = out, a;
+	uint64_t nshift = 0, nskip = 0, nbad = 0;
+	int state = t->state;
+	size_t n;
+
+	while (p < e) {
+		n = t->block(c, state, p, e - p, o);
+		p += n;
+		o += n;
+		if (p == e)
+			break;
+		a = c->act[state][*p++];
+		if (a & RCTR_SHIFT) {
+			state = a & ~RCTR_SHIFT;
+			nshift++;
+		} else if (a == RCTR_SKIP) {
+			/* Leader and trailer come in long runs */
+			nskip++;
+			for (; p < e && c->act[state][*p] == RCTR_SKIP; p++)
+				nskip++;
+		} else {
+			nbad++;
+			if (t->subst)
+				*o++ = t->subst;
+		}
+	}
+	t->state = state;
+	t->nin += len;
+	t->nout += o - out;
+	t->nshift += nshift;
+	t->nskip += nskip;
+	t->nbad += nbad;
+	return (o - out);
+}
@@ -0,0 +1,120 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Transcoder for the character codes found on paper tape.
+ *
+ * The reader delivers PORTB as is, channel 1 in bit 0.  A code is
+ * compiled into one 256 entry table per shift state:  map[] has the
+ * output character for every byte which simply prints in that state,
+ * and zero for the rest, which act[] then says what to do about:
+ * skip it (blank tape, rubout), change shift state, or count it as
+ * bad (parity error, unassigned code) and emit the substitute.
+ * lut[] is map[] without the parity check, for the vector paths which
+ * check parity on their own and then only need the data channels.
+ *
+ * Codes are described in a small text format, one directive per line:
+ *
+ *	# comment
+ *	name	ita2
+ *	mask	0x1f		# data channels, others are ignored
+ *	parity	odd 0xff	# channels covered, even or odd
+ *	skip	0x00 ...	# in every state
+ *	shift	0x1b figs	# in every state, switch to "figs"
+ *	state	ltrs		# the first of these is the initial state
+ *	0x03	a		# code and output in the current state
+ *	0x04	sp		# also \n \r \t \a \b \f or a number
+ *
+ * Codes and numbers are as strtoul(3) base 0, so octal works too.
+ * Codes are masked with the data channels, so mask goes first.
+ */
+
+#ifndef RCTR_H
+#define RCTR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RCTR_NSTATE	4
+
+#define RCTR_SKIP	0x10
+#define RCTR_BAD	0x20
+#define RCTR_SHIFT	0x40	/* | new state */
+
+/* Implementations of the table lookup, RCTR_BEST picks at runtime */
+#define RCTR_BEST	0
+#define RCTR_SCALAR	1
+#define RCTR_SSSE3	2
+#define RCTR_AVX2	3
+
+#define RCTR_OUTSZ(n)	(n)
+
+struct rctr_code {
+	char		name[32];
+	uint8_t		mask;		/* Data channels */
+	uint8_t		pmask;		/* Parity channels, 0 = none */
+	uint8_t		podd;
+	uint8_t		vmask;		/* Data channels, rounded up */
+	int		nstate;
+	char		sname[RCTR_NSTATE][16];
+	uint8_t		map[RCTR_NSTATE][256];
+	uint8_t		lut[RCTR_NSTATE][256];
+	uint8_t		act[RCTR_NSTATE][256];
+};
+
+typedef size_t rctr_block_f(const struct rctr_code *, int state,
+    const uint8_t *in, size_t len, uint8_t *out);
+
+struct rctr {
+	const struct rctr_code	*code;
+	int			state;
+	uint8_t			subst;	/* For bad codes, 0 = drop */
+	rctr_block_f		*block;
+	const char		*impl;
+
+	uint64_t		nin;
+	uint64_t		nout;
+	uint64_t		nbad;
+	uint64_t		nskip;
+	uint64_t		nshift;
+};
+
+int rctr_builtin(struct rctr_code *c, const char *name);
+int rctr_parse(struct rctr_code *c, const char *text, char *err,
+    size_t errlen);
+int rctr_load(struct rctr_code *c, FILE *f, char *err, size_t errlen);
+const char *rctr_list(int idx);
+
+void rctr_init(struct rctr *t, const struct rctr_code *c);
+int rctr_impl(struct rctr *t, int impl);
+size_t rctr_feed(struct rctr *t, const uint8_t *in, size_t len,
+    uint8_t *out);
+
+#endif /* RCTR_H */
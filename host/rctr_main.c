@@ -0,0 +1,168 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Transcode a raw (binary mode 'b') capture from the RC-2000 adapter.
+ *
+ *	rctr [-c code | -t table] [-s scalar|ssse3|avx2] [-u char] [-q] [file]
+ *	rctr -l
+ *
+ * -c picks a built in code (default ascii), -t reads a table file in
+ * the format described in rctr.h, such as flexowriter.tab, -l lists
+ * the built in codes.  Bad codes come out as the -u character, '?' by
+ * default, or not at all with -u ''.  The exit status is 1 if there
+ * were any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rctr.h"
+
+#define BUFSZ	(1 << 20)
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: rctr [-c code | -t table] "
+	    "[-s scalar|ssse3|avx2] [-u char] [-q] [file]\n"
+	    "       rctr -l\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct rctr_code code;
+	struct rctr t;
+	FILE *f = stdin, *tf;
+	uint8_t *in, *out;
+	const char *cname = "ascii", *tname = NULL, *subst = "?", *s;
+	char err[128];
+	size_t n, m;
+	int ch, i, impl = RCTR_BEST, quiet = 0;
+
+	while ((ch = getopt(argc, argv, "c:lqs:t:u:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cname = optarg;
+			break;
+		case 'l':
+			for (i = 0; (s = rctr_list(i)) != NULL; i++)
+				printf("%s\n", s);
+			exit(0);
+		case 'q':
+			quiet = 1;
+			break;
+		case 's':
+			if (!strcmp(optarg, "scalar"))
+				impl = RCTR_SCALAR;
+			else if (!strcmp(optarg, "ssse3"))
+				impl = RCTR_SSSE3;
+			else if (!strcmp(optarg, "avx2"))
+				impl = RCTR_AVX2;
+			else
+				usage();
+			break;
+		case 't':
+			tname = optarg;
+			break;
+		case 'u':
+			if (strlen(optarg) > 1)
+				usage();
+			subst = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+
+	if (tname != NULL) {
+		tf = fopen(tname, "r");
+		if (tf == NULL) {
+			perror(tname);
+			exit(2);
+		}
+		if (rctr_load(&code, tf, err, sizeof err)) {
+			fprintf(stderr, "%s: %s\n", tname, err);
+			exit(2);
+		}
+		fclose(tf);
+	} else if (rctr_builtin(&code, cname)) {
+		fprintf(stderr, "rctr: unknown code \"%s\", try -l\n", cname);
+		exit(2);
+	}
+	if (argc == 1) {
+		f = fopen(argv[0], "rb");
+		if (f == NULL) {
+			perror(argv[0]);
+			exit(2);
+		}
+	}
+
+	rctr_init(&t, &code);
+	t.subst = (uint8_t)subst[0];
+	if (rctr_impl(&t, impl)) {
+		fprintf(stderr, "rctr: implementation not supported here\n");
+		exit(2);
+	}
+	in = malloc(BUFSZ);
+	out = malloc(RCTR_OUTSZ(BUFSZ));
+	if (in == NULL || out == NULL) {
+		perror("malloc");
+		exit(2);
+	}
+	while ((n = fread(in, 1, BUFSZ, f)) > 0) {
+		m = rctr_feed(&t, in, n, out);
+		if (m > 0 && fwrite(out, 1, m, stdout) != m) {
+			perror("stdout");
+			exit(2);
+		}
+	}
+	if (ferror(f)) {
+		perror("read");
+		exit(2);
+	}
+	if (fflush(stdout)) {
+		perror("stdout");
+		exit(2);
+	}
+	if (!quiet)
+		fprintf(stderr,
+		    "%ju in, %ju out, %ju bad, %ju skipped, %ju shifts (%s, %s)\n",
+		    (uintmax_t)t.nin, (uintmax_t)t.nout, (uintmax_t)t.nbad,
+		    (uintmax_t)t.nskip, (uintmax_t)t.nshift, code.name, t.impl);
+	exit(t.nbad > 0);
+}
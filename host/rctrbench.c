@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Benchmark the rctr implementations against each other.
+ *
+ *	rctrbench [-g gigabytes] [-r shifts-per-thousand] [-e bad-per-million]
+ *
+ * For every built in code a 64MB tape image is generated from the
+ * compiled tables, with shifts and bad codes at the given rates.  One
+ * pass checks every implementation against the scalar one, then the
+ * image is fed repeatedly until the requested volume has passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rctr.h"
+
+#define GENSZ	(64 << 20)
+#define CHUNK	(1 << 20)
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static unsigned
+rnd(void)
+{
+	static uint64_t r = 1;
+
+	r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (r >> 33);
+}
+
+static void
+gen(const struct rctr_code *c, uint8_t *buf, size_t sz, unsigned rate,
+    unsigned ppm)
+{
+	unsigned nshift = 0, b, u;
+	uint8_t shift[256];
+	int s = 0;
+	size_t i;
+
+	for (b = 0; b < 256; b++)
+		if (c->act[0][b] & RCTR_SHIFT)
+			shift[nshift++] = b;
+	for (i = 0; i < sz; i++) {
+		u = rnd();
+		if (ppm > 0 && u % 1000000 < ppm) {
+			buf[i] = u >> 20;
+		} else if (nshift > 0 && u % 1000 < rate) {
+			buf[i] = shift[(u >> 10) % nshift];
+			s = c->act[s][buf[i]] & ~RCTR_SHIFT;
+		} else {
+			do
+				b = rnd() & 0xff;
+			while (c->map[s][b] == 0);
+			buf[i] = b;
+		}
+	}
+	/* Back in the initial state, so the image can be fed again */
+	for (b = 0; s != 0 && b < 256; b++) {
+		if (c->act[s][b] == (RCTR_SHIFT | 0)) {
+			buf[sz - 1] = b;
+			break;
+		}
+	}
+}
+
+static uint64_t
+hash(uint64_t h, const uint8_t *p, size_t n)
+{
+
+	while (n--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+	return (h);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *iname[] = { NULL, "scalar", "ssse3", "avx2" };
+	static struct rctr_code code;
+	struct rctr t;
+	uint8_t *buf, *out;
+	uint64_t total, h, ref_h = 0, ref_bad = 0;
+	size_t off, n;
+	double gb = 4, t0, d;
+	unsigned rate = 20, ppm = 0;
+	const char *cname;
+	int ch, ci, impl, ok, bad = 0;
+
+	while ((ch = getopt(argc, argv, "e:g:r:")) != -1) {
+		switch (ch) {
+		case 'e':
+			ppm = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gb = strtod(optarg, NULL);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: rctrbench [-g gigabytes] "
+			    "[-r shifts-per-thousand] [-e bad-per-million]\n");
+			exit(2);
+		}
+	}
+	buf = malloc(GENSZ);
+	out = malloc(RCTR_OUTSZ(GENSZ));
+	if (buf == NULL || out == NULL) {
+		perror("malloc");
+		exit(2);
+	}
+	total = (uint64_t)(gb * 1e9);
+
+	for (ci = 0; (cname = rctr_list(ci)) != NULL; ci++) {
+		(void)rctr_builtin(&code, cname);
+		gen(&code, buf, GENSZ, rate, ppm);
+		for (impl = RCTR_SCALAR; impl <= RCTR_AVX2; impl++) {
+			rctr_init(&t, &code);
+			if (rctr_impl(&t, impl)) {
+				printf("%-10s %-7s not supported\n",
+				    cname, iname[impl]);
+				continue;
+			}
+			n = rctr_feed(&t, buf, GENSZ, out);
+			h = hash(0xcbf29ce484222325ULL, out, n);
+			if (impl == RCTR_SCALAR) {
+				ref_h = h;
+				ref_bad = t.nbad;
+			}
+			ok = h == ref_h && t.nbad == ref_bad;
+
+			rctr_init(&t, &code);
+			(void)rctr_impl(&t, impl);
+			t0 = now();
+			for (off = 0; t.nin < total; off += CHUNK) {
+				if (off >= GENSZ)
+					off = 0;
+				(void)rctr_feed(&t, buf + off, CHUNK, out);
+			}
+			d = now() - t0;
+			printf("%-10s %-7s %8.2f GB in %6.3f s %8.2f GB/s"
+			    "  %ju bad %ju shifts%s\n",
+			    cname, t.impl, t.nin * 1e-9, d, t.nin * 1e-9 / d,
+			    (uintmax_t)t.nbad, (uintmax_t)t.nshift,
+			    ok ? "" : "  MISMATCH");
+			if (!ok)
+				bad = 1;
+		}
+	}
+	exit(bad);
+}
@@ -0,0 +1,107 @@
+/*-
+ * Copyright (c) 2010 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ */
+
+/*
+ * Check the self test pattern ('X1' or 'X2', binary mode 'b') from
+ * the RC-2000 adapter:  every byte must be one more than the one
+ * before it, modulo 256.  Text replies interleaved in the stream show
+ * up as breaks, the count of those is the exit status.
+ *
+ *	xcheck < /dev/cuaU0
+ *	xcheck capture.bin
+ *
+ * A tty is put in raw mode first, or 0x0d would come out as 0x0a and
+ * the echo would send the pattern back to the adapter as commands.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *f = stdin;
+	struct termios tio;
+	unsigned char buf[65536];
+	size_t n, i;
+	uint64_t off = 0, breaks = 0;
+	unsigned want = 0;
+	int first = 1;
+	double t0, t;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: xcheck [file]\n");
+		exit(2);
+	}
+	if (argc == 2) {
+		f = fopen(argv[1], "rb");
+		if (f == NULL) {
+			perror(argv[1]);
+			exit(2);
+		}
+	}
+	if (isatty(fileno(f)) && tcgetattr(fileno(f), &tio) == 0) {
+		cfmakeraw(&tio);
+		(void)tcsetattr(fileno(f), TCSANOW, &tio);
+	}
+	t0 = now();
+	while ((n = fread(buf, 1, sizeof buf, f)) > 0) {
+		for (i = 0; i < n; i++, off++) {
+			if (!first && buf[i] != want) {
+				if (breaks < 10)
+					fprintf(stderr,
+					    "break at %ju: 0x%02x, expected 0x%02x\n",
+					    (uintmax_t)off, buf[i], want);
+				breaks++;
+			}
+			first = 0;
+			want = (buf[i] + 1) & 0xff;
+		}
+	}
+	t = now() - t0;
+	printf("%ju bytes, %ju breaks", (uintmax_t)off, (uintmax_t)breaks);
+	if (f == stdin && t > 0)
+		printf(", %.0f B/s", off / t);
+	printf("\n");
+	exit(breaks > 255 ? 255 : (int)breaks);
+}
@@ -32,6 +32,10 @@ typedef unsigned char __sfr;
 #endif
 
 #define SERIAL	0
+#define TEE	0		// Tee the capture stream to UART2
+#define FRAMED	1		// Framed, retransmittable output on EP1
+#define PROFILE	0		// Time handlers, report with 'P'
+#define HOLD	1		// Hold the capture on DTR drop, 'Z' resumes
 
 #include "pic18fregs.h"
 
@@ -45,6 +49,8 @@ typedef unsigned char __sfr;
 #endif
 
 #pragma stack 0x200 0x100
+#define STACK_LO	0x200		// Must match the pragma above
+#define STACK_SZ	0x100
 
 /* Enable the watchdog at 4msec * 64 = .256 sec */
 code unsigned char at(__CONFIG2H) config2h = (0x7 << 1) | 1;
@@ -78,141 +84,1647 @@ code unsigned char at(__CONFIG1L) config1l = 0
 
 /* Serial port defines -----------------------------------------------*/
 
+#if SERIAL && TEE
+#error "SERIAL and TEE both want UART2"
+#endif
+
+#if TEE
+/*
+ * UART2: TX = RP0/RA0, RX = RP1/RA1, CTS# = RC1 (in), RTS# = RC2 (out)
+ * CTS# is also routed to INT1 so a stalled transmitter restarts
+ * as soon as the far end is ready again.
+ */
+#define TEE_BAUD	1000000UL	// 1, 1.5, 2 and 3 Mbaud are exact
+
+#define SERIAL_CTS2	(!PORTCbits.RC1)
+#define SERIAL_CTSWAIT2							\
+	do {								\
+		INTCON3bits.INT1IF = 0;					\
+		INTCON3bits.INT1IE = 1;					\
+		if (!PORTCbits.RC1)					\
+			INTCON3bits.INT1IF = 1;				\
+	} while (0)
+#define SERIAL_RTS2(x)	do { PORTCbits.RC2 = !(x); } while (0)
+#endif
+
+#if SERIAL || TEE
+
+#define SERIALPORTS (1 << 2)
+
+#include "serial.c"
+
+#endif
+
 #if SERIAL
 
-#define SERIALPORTS (1 << 2)
+void
+putchar(char c) __wparam
+{
+
+	serial_tx(2, c);
+}
+
+#endif
+
+/**********************************************************************
+ * Uptime clock and boot timestamps.
+ *
+ * TMR0 runs from reset at 48MHz / (4 * 256), its overflow interrupt
+ * extends it to 32 bits.  The first time the USB code enters each
+ * device state the clock is recorded, so boot to CONFIGURED can be
+ * read back with 'T'.
+ */
+
+#define T0HZ		46875UL
+#define T0MS(t)		((t) / 750UL * 16UL + (t) % 750UL * 16UL / 750UL)
+#define PLL_TICKS	((uint16_t)(2 * T0HZ / 1000 + 1))	// TPLL = 2ms
+
+static volatile uint16_t t0hi;
+static uint32_t boot_ts[6];		// Indexed by USB device state
+static uint8_t boot_rcon;		// Reset cause
+
+static uint32_t
+ticks(void)
+{
+	uint16_t h, l;
+	uint8_t f;
+
+	do {
+		h = t0hi;
+		l = TMR0L;			// Latches TMR0H
+		l |= (uint16_t)TMR0H << 8;
+		f = INTCONbits.TMR0IF;
+	} while (h != t0hi);
+	if (f && !(l & 0x8000))
+		h++;			// Overflow not yet counted
+	return (((uint32_t)h << 16) | l);
+}
+
+static void
+boot_stamp(uint8_t state) __wparam
+{
+
+	if (state < sizeof boot_ts / sizeof boot_ts[0] && boot_ts[state] == 0)
+		boot_ts[state] = ticks();
+}
+
+#define USB_STATE_HOOK(state)	boot_stamp(state)
+
+/**********************************************************************
+ * Stack high-water mark.
+ *
+ * The stack grows down from the top of its bank.  Before interrupts
+ * are enabled, everything below the current stack pointer is painted,
+ * and 'S' reports how much of it has been overwritten since.
+ */
+
+#define STACK_PAINT	0xa5
+#define STACK_GAP	16		// Leave room for stack_paint() itself
+
+static uint16_t
+stack_sp(void)
+{
+
+	return (FSR1L | ((uint16_t)FSR1H << 8));
+}
+
+static void
+stack_paint(void)
+{
+	__data uint8_t *p = (__data uint8_t *)STACK_LO;
+	__data uint8_t *top = (__data uint8_t *)(stack_sp() - STACK_GAP);
+
+	for (; p < top; p++)
+		*p = STACK_PAINT;
+}
+
+static uint16_t
+stack_used(void)
+{
+	__data uint8_t *p = (__data uint8_t *)STACK_LO;
+	uint16_t u;
+
+	for (u = 0; u < STACK_SZ && p[u] == STACK_PAINT; u++)
+		continue;
+	return (STACK_SZ - u);
+}
+
+/**********************************************************************
+ * Profiler.
+ *
+ * Handlers are timed against the free running TMR3 (1.5MHz, one tick
+ * is 8 instruction cycles), and each keeps count, min, max, sum and a
+ * histogram in power of two buckets from 16 ticks up.  'P' reports
+ * and clears them one line at a time.  intr_l includes any intr_h
+ * that came in on top of it.
+ */
+
+static uint16_t
+tmr3(void)
+{
+	uint16_t x;
+	uint8_t gie;
+
+	gie = INTCONbits.GIEH;		// intr_h() reads it too
+	INTCONbits.GIEH = 0;
+	x = TMR3L;			// RD16: latches TMR3H
+	x |= (uint16_t)TMR3H << 8;
+	INTCONbits.GIEH = gie;
+	return (x);
+}
+
+#if PROFILE
+
+#define PROF_INTR_H	0
+#define PROF_SETUP	1
+#define PROF_INDATA	2
+#define PROF_BUSRESET	3
+#define PROF_DOCHAR	4
+#define PROF_SEND	5
+#define PROF_ECHO	6
+#define PROF_INTR_L	7
+#define PROF_DRAIN	8
+#define PROF_N		9
+#define PROF_HIST	8
+
+static const char * const prof_name[PROF_N] = {
+	"intr_h", "SetupStage", "InDataStage", "BusReset",
+	"dochar", "Send", "USBEcho", "intr_l", "capq_drain"
+};
+
+struct prof {
+	uint16_t	n;
+	uint16_t	min;
+	uint16_t	max;
+	uint32_t	sum;
+	uint16_t	hist[PROF_HIST];
+};
+
+static struct prof prof[PROF_N];
+static uint16_t prof_t0[PROF_N];
+static uint8_t prof_next;		// Next line of the 'P' report
+
+static void
+prof_exit(uint8_t i, uint16_t t0)
+{
+	struct prof *pp = &prof[i];
+	uint16_t t, u;
+	uint8_t b;
+
+	t = tmr3() - t0;
+	if (pp->n == 0xffff)
+		return;
+	if (pp->n == 0 || t < pp->min)
+		pp->min = t;
+	if (t > pp->max)
+		pp->max = t;
+	pp->n++;
+	pp->sum += t;
+	for (b = 0, u = t >> 4; u != 0 && b < PROF_HIST - 1; b++)
+		u >>= 1;
+	pp->hist[b]++;
+}
+
+#define PROF_ENTER(i)		do { prof_t0[i] = tmr3(); } while (0)
+#define PROF_EXIT(i)		prof_exit(i, prof_t0[i])
+
+#else
+
+#define PROF_ENTER(i)		do { } while (0)
+#define PROF_EXIT(i)		do { } while (0)
+
+#endif
+
+#define USB_PROF_ENTER(i)	PROF_ENTER(i)
+#define USB_PROF_EXIT(i)	PROF_EXIT(i)
+
+#include "usb.c"
+
+#if FRAMED
+#include "frame.c"
+#endif
+
+#include "flash.c"
+
+/*********************************************************************/
+/*
+ * txBuffer has room for one worst case character beyond a full packet,
+ * so encoders never leave a packet short, Send() moves the tail down.
+ */
+#define TXPKT		PIPE_1_SZ_IN
+#define TXSLACK		12
+static uint8_t txBuffer[TXPKT + TXSLACK];
+static uint8_t txbp;
+static uint8_t rxBuffer[64];
+static uint8_t rxbp, rxbe;
+static uint8_t loop;
+
+/*
+ * Output encodings.  ocost[] is the worst case number of bytes one
+ * tape character can turn into, including line starts and ends.
+ */
+#define HMODE_BIN	0	// Raw bytes
+#define HMODE_HEX	1	// "xx\r\n" per character
+#define HMODE_DUMP16	2	// "oooooo:" + 16 * "xx" + "\r\n"
+#define HMODE_DUMP32	3	// "oooooo:" + 32 * "xx" + "\r\n"
+#define HMODE_B64	4	// Base64, 64 characters per line
+#define HMODE_NONE	0xff	// No mode change pending
+
+static const uint8_t ocost[] = { 1, 4, 11, 11, 6 };
+
+CTASSERT(TXSLACK >= 11);
+
+static uint8_t hmode;
+static uint8_t hmode_next = HMODE_NONE;	// Waiting for setmode_poll()
+static uint8_t ocol;		// Bytes in line (dump) or chars in line (b64)
+static uint8_t b64n;		// Pending base64 input bytes
+static uint8_t b64b[2];
+static uint32_t ooff;		// Offset of next byte in dump modes
+static uint8_t fmode;
+static uint8_t cmdarg;		// Command waiting for its argument byte
+
+#if FRAMED
+#define TXFULL()	(txbp >= (fmode ? FRAME_PAYLOAD : TXPKT))
+#else
+#define TXFULL()	(txbp >= TXPKT)
+#endif
+
+#define TEE_OFF		0	// USB only
+#define TEE_BOTH	1	// USB and UART2
+#define TEE_ONLY	2	// UART2 only
+
+#if TEE
+static uint8_t tmode;
+#else
+#define tmode		TEE_OFF
+#endif
+
+static const uint8_t hex[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+};
+
+static void
+emit(uint8_t c) __wparam
+{
+
+	if (tmode != TEE_ONLY)
+		txBuffer[txbp++] = c;
+#if TEE
+	if (tmode != TEE_OFF)
+		serial_tx(2, c);
+#endif
+}
+
+/* Room for one more character in every enabled output */
+static uint8_t
+outroom(void)
+{
+
+	if (hmode_next != HMODE_NONE)
+		return (0);			// See setmode()
+	if (tmode != TEE_ONLY) {
+		if (txbp >= TXPKT) 
+			return (0);
+		if ((CDC_modem & 3) != 3)		/* DTR + RTS */
+			return (0);
+	}
+#if TEE
+	if (tmode != TEE_OFF && serial_txrdy(2) < ocost[hmode])
+		return (0);
+#endif
+	return (1);
+}
+
+static const uint8_t b64[64] = {
+	'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+	'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+	'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
+	'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+	'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+	'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+	'w', 'x', 'y', 'z', '0', '1', '2', '3',
+	'4', '5', '6', '7', '8', '9', '+', '/'
+};
+
+static void
+emitcrlf(void)
+{
+
+	emit('\r');
+	emit('\n');
+	ocol = 0;
+}
+
+/* Encode b64b[0..1] and c, n of which are real */
+static void
+emitb64(uint8_t c, uint8_t n)
+{
+
+	emit(b64[b64b[0] >> 2]);
+	emit(b64[((b64b[0] & 0x03) << 4) | (b64b[1] >> 4)]);
+	emit(n > 1 ? b64[((b64b[1] & 0x0f) << 2) | (c >> 6)] : '=');
+	emit(n > 2 ? b64[c & 0x3f] : '=');
+	b64n = 0;
+	ocol += 4;
+}
+
+static void
+putcap(uint8_t c) __wparam
+{
+
+	switch (hmode) {
+	case HMODE_BIN:
+		emit(c);
+		break;
+	case HMODE_HEX:
+		emit(hex[((c & 0xf0) >> 4)]);
+		emit(hex[(c & 0xf)]);
+		emitcrlf();
+		break;
+	case HMODE_DUMP16:
+	case HMODE_DUMP32:
+		if (ocol == 0) {
+			emit(hex[(ooff >> 20) & 0xf]);
+			emit(hex[(ooff >> 16) & 0xf]);
+			emit(hex[(ooff >> 12) & 0xf]);
+			emit(hex[(ooff >> 8) & 0xf]);
+			emit(hex[(ooff >> 4) & 0xf]);
+			emit(hex[ooff & 0xf]);
+			emit(':');
+		}
+		emit(hex[((c & 0xf0) >> 4)]);
+		emit(hex[(c & 0xf)]);
+		ooff++;
+		if (++ocol == (hmode == HMODE_DUMP16 ? 16 : 32))
+			emitcrlf();
+		break;
+	case HMODE_B64:
+		if (b64n < 2) {
+			b64b[b64n++] = c;
+			break;
+		}
+		emitb64(c, 3);
+		if (ocol >= 64)
+			emitcrlf();
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Finish a partial line or base64 group, used when the reader stops
+ * and before the encoding changes.  Needs outroom().
+ */
+static void
+putflush(void)
+{
+
+	if (hmode == HMODE_B64 && b64n > 0) {
+		if (b64n < 2)
+			b64b[1] = 0;
+		emitb64(0, b64n);
+	}
+	if (ocol > 0)
+		emitcrlf();
+}
+
+/* Strobe the reader, return the character it presented */
+static uint8_t
+readchar(void)
+{
+	uint8_t c, u;
+
+	c = PORTB;
+	/* XXX: validation read, to check PORTB bits are stable ? */
+	PORTCbits.RC6 = 0;
+	for (u = 0; u < 10; u++)
+		if(!PORTCbits.RC7)
+			break;
+	/* XXX: calibrate width of strobe pulse */
+	for (u = 0; u < 30; u++)		/* 41.6 miuroseconds */
+		;
+	PORTCbits.RC6 = 1;
+	return (c);
+}
+
+/*
+ * Running CRC-32 (IEEE 802.3, as zlib and cksum -a crc32b) and count
+ * of every character captured since the transport was last started.
+ * Nibble at a time, to keep the table at 64 bytes.
+ */
+static const code uint32_t crc32_tbl[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static uint32_t tape_crc;		// Inverted, as the algorithm runs
+static uint32_t tape_len;
+static uint8_t tape_run;		// Transport has run, not reported
+static uint8_t tape_pend;		// A new tape starts at capq[tape_mark]
+static uint8_t tape_mark;
+static uint8_t tape_old;		// ... once the old one is reported
+
+static void
+tape_add(uint8_t c) __wparam
+{
+
+	tape_crc = crc32_tbl[(uint8_t)(tape_crc ^ c) & 0xf] ^ (tape_crc >> 4);
+	tape_crc = crc32_tbl[(uint8_t)(tape_crc ^ (c >> 4)) & 0xf] ^
+	    (tape_crc >> 4);
+	tape_len++;
+}
+
+/**********************************************************************
+ * Both the rate timer and the hardware paced mode strobe the reader
+ * from the low priority interrupt and pass the characters through
+ * capq to the main loop.
+ */
+
+#define CAPQ_SZ		32		// Power of two
+
+static uint8_t capq[CAPQ_SZ];
+static volatile uint8_t capq_r, capq_w;
+
+#define CAPQ_FULL()	(((capq_w + 1) & (CAPQ_SZ - 1)) == capq_r)
+
+/* Read job state the interrupt needs, see "Read jobs" below */
+#define JOB_COUNT	1		// Got the characters asked for
+#define JOB_IDLE	2		// Reader not ready for too long
+#define JOB_EOT		3		// End of tape, not ready
+#define JOB_BLANK	4		// End of tape, trailing blanks
+
+static volatile uint32_t job_left;	// Characters still to read, 0 = any
+static volatile uint8_t job_end;	// Why the job ended, 0 = running
+static uint32_t job_count;		// Characters since the job was armed
+static uint8_t job_data;		// Seen a non-blank, past the leader
+static uint8_t job_blanks;		// Length of the current run of blanks
+static uint8_t eot_blank;		// End of tape after this many blanks
+
+/* Self test, see "USB throughput self test" below */
+#define XMODE_RATE	1		// Pattern at the rate timer's pace
+#define XMODE_FLAT	2		// Pattern as fast as EP1 drains
+
+static uint8_t xmode;
+static uint8_t xpat;			// Next pattern byte
+
+/*
+ * The transport is about to start.  capq may still hold the tail of
+ * the last run, so the count and CRC start over when capq_drain() gets
+ * to the first new character, see tape_turn().
+ */
+static void
+tape_start(void)
+{
+
+	tape_pend = 1;
+	tape_mark = capq_w;
+	tape_old |= tape_run;
+	tape_run = 0;
+}
+
+static void
+capq_put(void)
+{
+
+	if (xmode)
+		capq[capq_w] = xpat++;
+	else
+		capq[capq_w] = readchar();
+	capq_w = (capq_w + 1) & (CAPQ_SZ - 1);
+	if (job_left != 0 && --job_left == 0) {
+		/* Stop right here, the main loop tidies up */
+		PIE1bits.CCP1IE = 0;
+		INTCON3bits.INT2IE = 0;
+		PIE2bits.CCP2IE = 0;
+		job_end = JOB_COUNT;
+	}
+}
+
+/* Single step, in line behind whatever capq already has */
+static void
+dochar(void)
+{
+
+	if (!PORTCbits.RC7 || CAPQ_FULL())
+		return;
+	PROF_ENTER(PROF_DOCHAR);
+	INTCONbits.GIEL = 0;
+	capq_put();
+	INTCONbits.GIEL = 1;
+	PROF_EXIT(PROF_DOCHAR);
+}
+
+/**********************************************************************
+ * Rate timer.
+ *
+ * CCP1 in special event mode resets TMR1 on every match, so the strobe
+ * period is kept by hardware and interrupt latency does not accumulate.
+ * rate is the period in 1/256 TMR1 ticks, and the fraction is carried
+ * from one period to the next, so the average rate is exact to a few
+ * ppm for any cps.  Zero means single step.
+ */
+
+#define T1HZ		1500000UL	// 48MHz / (4 * 8)
+#define CPS_RATE(cps)	((T1HZ * 256UL + (cps) / 2) / (cps))
+#define RATE_MAX	0xfffeffUL	// 16 bit CCPR1 with the carry, ~23 cps
+#define RATE_MIN	CPS_RATE(4000)
+
+CTASSERT((RATE_MAX >> 8) + 1 <= 0xffff);	// per++ must not wrap to 0
+
+static const code uint32_t speeds[9] = {
+	CPS_RATE(50),			// '1'
+	CPS_RATE(100),			// '2'
+	CPS_RATE(200),			// '3'
+	CPS_RATE(380),			// '4'
+	CPS_RATE(718),			// '5'
+	CPS_RATE(1034),			// '6'
+	CPS_RATE(1411),			// '7'
+	CPS_RATE(1780),			// '8'
+	CPS_RATE(2479),			// '9'
+};
+
+/*
+ * Ramps: starting from standstill the reader is started at RAMP_CPS,
+ * or the target if that is slower, and the period is stepped linearly
+ * to the target over ramp_len characters.  Speed changes ramp the same
+ * way, and stopping ramps down to RAMP_CPS before the timer is halted.
+ * ramp_len = 0 switches ramps off.
+ */
+#define RAMP_CPS	100
+#define RAMP_LEN	32		// Characters
+#define RAMP_BASE	CPS_RATE(RAMP_CPS)
+
+static uint32_t rate;			// Target period, 0 = stop
+static uint32_t rate_cur;		// Current period, 0 = stopped
+static uint32_t rate_end;		// Where the ramp ends
+static uint32_t rate_step;		// Ramp step per character
+static uint8_t rate_acc;
+static uint8_t ramp_len;
+
+static void
+rate_start(void)
+{
+	uint16_t per;
+
+	tape_start();
+	rate_acc = 0;
+	per = rate_cur >> 8;
+	TMR1H = 0;
+	TMR1L = 0;
+	CCPR1H = per >> 8;
+	CCPR1L = per & 0xff;
+	PIR1bits.CCP1IF = 0;
+	PIE1bits.CCP1IE = 1;
+}
+
+/* Stop at once, no ramp */
+static void
+rate_halt(void)
+{
+
+	PIE1bits.CCP1IE = 0;
+	rate = 0;
+	rate_cur = 0;
+}
+
+static void
+rate_set(uint32_t r)
+{
+	uint8_t running;
+	uint32_t d;
+
+	if (r > RATE_MAX)
+		r = RATE_MAX;			// A rate saved before the cap
+	PIE1bits.CCP1IE = 0;
+	running = rate_cur != 0;
+	if (running && r == rate) {
+		PIE1bits.CCP1IE = 1;		// Already on its way
+		return;
+	}
+	rate = r;
+	if (ramp_len == 0 || (r == 0 && (!running || rate_cur >= RAMP_BASE))) {
+		rate_cur = r;
+		rate_end = r;
+	} else {
+		if (!running)
+			rate_cur = r > RAMP_BASE ? r : RAMP_BASE;
+		rate_end = r ? r : RAMP_BASE;
+		if (rate_cur > rate_end)
+			d = rate_cur - rate_end;
+		else
+			d = rate_end - rate_cur;
+		rate_step = d / ramp_len + 1;
+	}
+	if (rate_cur == 0)
+		return;
+	if (running)
+		PIE1bits.CCP1IE = 1;
+	else
+		rate_start();
+}
+
+/* Called from intr_l() */
+static void
+rate_intr(void)
+{
+	uint16_t per;
+	uint8_t acc;
+
+	if (!PIE1bits.CCP1IE || !PIR1bits.CCP1IF)
+		return;
+	PIR1bits.CCP1IF = 0;
+
+	if (rate_cur > rate_end) {
+		if (rate_cur - rate_end > rate_step)
+			rate_cur -= rate_step;
+		else
+			rate_cur = rate_end;
+	} else if (rate_cur < rate_end) {
+		if (rate_end - rate_cur > rate_step)
+			rate_cur += rate_step;
+		else
+			rate_cur = rate_end;
+	} else if (rate == 0) {
+		/* Ramped down, stop */
+		PIE1bits.CCP1IE = 0;
+		rate_cur = 0;
+		return;
+	}
+
+	/* TMR1 was reset by the match, set up the period after this */
+	per = rate_cur >> 8;
+	acc = rate_acc + (uint8_t)rate_cur;
+	if (acc < rate_acc)
+		per++;
+	rate_acc = acc;
+	CCPR1H = per >> 8;
+	CCPR1L = per & 0xff;
+
+	if ((PORTCbits.RC7 || xmode) && !CAPQ_FULL())
+		capq_put();
+}
+
+/**********************************************************************
+ * Hardware paced mode.
+ *
+ * RC7 (ready) is also routed to INT2, and the low priority interrupt
+ * strobes the reader on its rising edge, so the tape runs as fast as
+ * the reader itself allows.  Strobes are kept at least pace_min TMR3
+ * ticks apart by deferring early ones to a CCP2 compare on TMR3.
+ * Like the rate timer it stops strobing when capq is full.
+ */
+
+#define T3HZ		1500000UL	// 48MHz / (4 * 8)
+#define PACE_MIN_US	350		// Default minimum strobe period
+#define PACE_TICKS(us)	((uint16_t)((us) * (T3HZ / 100000UL) / 10))
+
+static volatile uint8_t pmode;
+static uint16_t pace_min;
+static uint16_t pace_last;
+
+/* (Re)arm INT2, fire it at once if the reader is already ready */
+static void
+pace_arm(void)
+{
+
+	INTCON3bits.INT2IF = 0;
+	INTCON3bits.INT2IE = 1;
+	if (PORTCbits.RC7)
+		INTCON3bits.INT2IF = 1;
+}
+
+static void
+pace_stop(void)
+{
+
+	INTCON3bits.INT2IE = 0;
+	PIE2bits.CCP2IE = 0;
+	pmode = 0;
+}
+
+/* Start strobing, also again after a hold */
+static void
+pace_go(void)
+{
+
+	pace_last = tmr3() - pace_min;
+	pmode = 1;
+	pace_arm();
+}
+
+static void
+pace_start(void)
+{
+
+	pace_stop();
+	tape_start();			// capq keeps what was read before
+	pace_go();
+}
+
+/* Called from intr_l() */
+static void
+pace_intr(void)
+{
+	uint16_t when;
+
+	if (PIE2bits.CCP2IE && PIR2bits.CCP2IF) {
+		PIE2bits.CCP2IE = 0;
+		PIR2bits.CCP2IF = 0;
+		pace_arm();
+	}
+	if (!INTCON3bits.INT2IE || !INTCON3bits.INT2IF)
+		return;
+	INTCON3bits.INT2IF = 0;
+	if (!PORTCbits.RC7)
+		return;
+	if (CAPQ_FULL()) {
+		/* Main loop re-arms us when it drains capq */
+		INTCON3bits.INT2IE = 0;
+		return;
+	}
+	if (tmr3() - pace_last < pace_min) {
+		INTCON3bits.INT2IE = 0;
+		when = pace_last + pace_min;
+		CCPR2H = when >> 8;
+		CCPR2L = when & 0xff;
+		PIR2bits.CCP2IF = 0;
+		PIE2bits.CCP2IE = 1;
+		if (tmr3() - pace_last >= pace_min)
+			PIR2bits.CCP2IF = 1;	// Raced past it
+		return;
+	}
+	pace_last = tmr3();
+	capq_put();
+}
+
+/* Called from the main loop, moves capq to the outputs */
+static void
+capq_drain(void)
+{
+	uint8_t c;
+
+	PROF_ENTER(PROF_DRAIN);
+	while (capq_r != capq_w && outroom() &&
+	    !(tape_pend && capq_r == tape_mark)) {
+		c = capq[capq_r];
+		putcap(c);
+		tape_add(c);
+		capq_r = (capq_r + 1) & (CAPQ_SZ - 1);
+		job_count++;
+		if (c != 0) {
+			job_blanks = 0;
+			job_data = 1;
+		} else if (job_data && eot_blank != 0 &&
+		    ++job_blanks == eot_blank && job_end == 0) {
+			job_end = JOB_BLANK;
+		}
+	}
+	INTCONbits.GIEL = 0;
+	if (pmode && !INTCON3bits.INT2IE && !PIE2bits.CCP2IE && !CAPQ_FULL() &&
+	    !job_end)
+		pace_arm();
+	INTCONbits.GIEL = 1;
+	PROF_EXIT(PROF_DRAIN);
+}
+
+static const char usage[] =
+	"\r\n\n"
+	"RC-2000 USB adapter\r\n"
+	"===================\r\n"
+	"0:\tSingle Step\r\n"
+	"1-9:\tSet Speed\r\n"
+	"+:\tFaster\r\n"
+	"-:\tSlower\r\n"
+	"m:\tAs fast as the reader is ready\r\n"
+	"M<n>:\tMinimum period n * 10us\r\n"
+	"A<n>:\tRamp over n characters, 0 = off\r\n"
+	"N<nnn>:\tRead n characters, 24 bits LSB first\r\n"
+	"U<n>:\tRead until not ready for n * 10ms\r\n"
+	"E<n>:\tEnd of tape after n * 10ms not ready, 0 = off\r\n"
+	"B<n>:\tEnd of tape after n blanks, 0 = off\r\n"
+	"W:\tSave settings in flash\r\n"
+	"T:\tBoot timestamps\r\n"
+	"C:\tCount and CRC-32 since start\r\n"
+	"X0-2:\tSelf test off, at rate, flat out\r\n"
+	"S:\tStack high-water mark\r\n"
+#if HOLD
+	"Z<nnnn>:\tResume at offset n, 32 bits LSB first\r\n"
+#endif
+#if PROFILE
+	"P:\tProfile report, times in us\r\n"
+#endif
+	"b:\tBinary mode\r\n"
+	"h:\tHex mode\r\n"
+	"d, D:\tHexdump mode, 16 or 32 per line\r\n"
+	"e:\tBase64 mode\r\n"
+#if FRAMED
+	"f:\tFramed mode on/off\r\n"
+	"R<n>:\tResend frame n\r\n"
+#endif
+#if TEE
+	"t:\tTee to UART: off/both/only\r\n"
+#endif
+	"?:\tThis help\r\n"
+	"\n"
+	"2010-02-20 Poul-Henning Kamp\r\n"
+	"\n";
+
+static uint32_t tx_bytes, tx_pkts;	// Since the self test started
+
+#if HOLD
+/*
+ * Resumable capture, see "Hold and resume" below.  Every byte handed
+ * to the bulk pipe in plain (not framed, not iso) mode has an offset,
+ * tx_off counts them, and the last HIST_SZ are kept in hist[] so a
+ * host which lost some can have them again.  The reply to 'Z' and any
+ * replay go out ahead of txBuffer.
+ */
+#define HIST_SZ		512		// Power of two
+#define RS_HDR		10
+
+CTASSERT((HIST_SZ & (HIST_SZ - 1)) == 0);
+
+static uint8_t hist[HIST_SZ];
+static uint16_t hist_n;			// Valid bytes in hist[]
+static uint32_t tx_off;			// Offset of the next byte
+static uint8_t held;			// Capture held, nothing goes out
+static uint8_t rs_hdr[RS_HDR];		// Reply to 'Z' waiting for EP1
+static uint8_t rs_n;
+static uint32_t rs_off, rs_end;		// Replay still to go
+
+#define RESUMING()	(rs_n != 0 || rs_off != rs_end)
+
+static void
+hist_put(const uint8_t *p, uint8_t len)
+{
+
+	while (len--) {
+		hist[(uint16_t)tx_off & (HIST_SZ - 1)] = *p++;
+		tx_off++;
+		if (hist_n < HIST_SZ)
+			hist_n++;
+	}
+}
+
+static void
+resume_pkt(void)
+{
+	uint16_t i, n;
+
+	if (rs_n != 0) {
+		if (InPipe(1, rs_hdr, rs_n) != 0)
+			rs_n = 0;
+		return;
+	}
+	i = (uint16_t)rs_off & (HIST_SZ - 1);
+	n = HIST_SZ - i;
+	if (n > rs_end - rs_off)
+		n = rs_end - rs_off;
+	if (n > PIPE_1_SZ_IN)
+		n = PIPE_1_SZ_IN;
+	rs_off += InPipe(1, hist + i, n);
+}
+#endif
+
+static void
+send_pkt(void)
+{
+	uint8_t j, u;
+
+#if HOLD
+	if (RESUMING()) {
+		resume_pkt();
+		return;
+	}
+	if (held)
+		return;
+#endif
+	if (isoAlt)
+		j = IsoPipe(txBuffer, txbp);
+	else
+#if FRAMED
+	if (fmode) {
+		if (!frame_push())
+			return;
+		j = frame_build(txBuffer, txbp);
+	} else
+#endif
+	{
+		j = InPipe(1, txBuffer, txbp);
+#if HOLD
+		hist_put(txBuffer, j);
+#endif
+	}
+	if (j == 0)
+		return;
+	tx_bytes += j;
+	tx_pkts++;
+	txbp -= j;
+	for (u = 0; u < txbp; u++)
+		txBuffer[u] = txBuffer[u + j];
+#if FRAMED
+	if (fmode && !isoAlt)
+		(void)frame_push();
+#endif
+}
+
+static void
+Send(void)
+{
+
+	PROF_ENTER(PROF_SEND);
+	send_pkt();
+	PROF_EXIT(PROF_SEND);
+}
+
+/*
+ * Text replies go in the data stream.  puttext() only queues a
+ * reference, usually to a constant in code space, and txq_pump()
+ * copies it into txBuffer as room frees up, so a long text never
+ * holds up the main loop.  The one RAM buffer, line[], must not be
+ * reused while it is still queued, see line_busy().
+ */
+#define TXQ_SZ		4		// Power of two
+
+static const char *txq[TXQ_SZ];
+static uint8_t txq_r, txq_w;
+static char line[112];
+
+static void
+puttext(const char *p)
+{
+
+	if ((uint8_t)(txq_w - txq_r) >= TXQ_SZ)
+		return;				// Full, drop it
+	txq[txq_w++ & (TXQ_SZ - 1)] = p;
+}
+
+static uint8_t
+line_busy(void)
+{
+	uint8_t u;
+	const char *p;
+
+	for (u = txq_r; u != txq_w; u++) {
+		p = txq[u & (TXQ_SZ - 1)];
+		if (p >= line && p < line + sizeof line)
+			return (1);
+	}
+	return (0);
+}
+
+static void
+txq_pump(void)
+{
+	const char *p;
+
+	while (txq_r != txq_w && !TXFULL()) {
+		p = txq[txq_r & (TXQ_SZ - 1)];
+		while (*p != '\0' && !TXFULL())
+			txBuffer[txbp++] = *p++;
+		if (*p == '\0')
+			txq_r++;
+		else
+			txq[txq_r & (TXQ_SZ - 1)] = p;
+	}
+}
+
+#if PROFILE
+/* One line of the 'P' report, the slot is cleared once it is copied */
+#define PROF_US(t)	((uint16_t)((t) * 2UL / 3UL))
+
+static void
+prof_report(void)
+{
+	struct prof p;
+	uint8_t i = prof_next++;
+
+	INTCONbits.GIEH = 0;
+	memcpy(&p, &prof[i], sizeof p);
+	memset(&prof[i], 0, sizeof prof[i]);
+	INTCONbits.GIEH = 1;
+	sprintf(line, "%s n %u us %u/%u/%u hist %u %u %u %u %u %u %u %u\r\n",
+	    prof_name[i], p.n, PROF_US(p.min),
+	    PROF_US(p.n ? p.sum / p.n : 0), PROF_US(p.max),
+	    p.hist[0], p.hist[1], p.hist[2], p.hist[3],
+	    p.hist[4], p.hist[5], p.hist[6], p.hist[7]);
+	puttext(line);
+}
+#endif
+
+/**********************************************************************
+ * Read jobs.
+ *
+ * 'N' and three bytes, least significant first, limits the read to
+ * that many characters; the interrupt stops the transport on the last
+ * one, so not one more is strobed.  'U<t>' ends the read once no
+ * character has arrived for t * 10ms while the transport runs.  Either
+ * arms a job, which is then started with a speed or 'm' as usual.
+ * When it ends, the captured characters are flushed out and followed
+ * by a "job" line with the reason and count.
+ *
+ * End of tape detection is the same thing without a count: with 'E<t>'
+ * or 'B<n>' set, every read is a job that ends when the reader has not
+ * been ready for t * 10ms, or when n blanks follow the first non-blank
+ * character (the leader does not count).  It is reported as "eot".
+ */
+
+static uint8_t job_on;
+static uint32_t eot_idle;		// Not ready timeout in T0 ticks
+static uint8_t eot_arg;			// ... as given to 'E'
+static uint32_t job_idle;		// Not ready timeout in T0 ticks
+static uint32_t job_last;		// ticks() of the last sign of life
+static uint8_t job_seen;		// capq_w as job_poll() last saw it
+static uint32_t job_arg;		// 'N' argument being assembled
+static uint8_t job_argn;
+
+static void
+job_arm(void)
+{
+
+	job_on = 1;
+	job_end = 0;
+	job_count = 0;
+	job_data = 0;
+	job_blanks = 0;
+	job_last = ticks();
+	job_seen = capq_w;
+}
 
-#include "serial.c"
+static void
+eot_set(uint8_t t)
+{
 
-/*********************************************************************/
-static uint8_t pcbuf[256];
-static volatile uint8_t pcbuf_r;
-static volatile uint8_t pcbuf_w;
-static volatile uint8_t pcoflo;
+	eot_arg = t;
+	eot_idle = t * (T0HZ / 100UL);
+}
 
 static void
-pc_poll(void)
+job_cancel(void)
 {
-	uint8_t c;
 
-	// INTCON = 0x00;
-	if (!SERIAL_TXRDY(2)) {
-		
-	} else if (pcbuf_r == pcbuf_w && pcoflo) {
-		SERIAL_TX(2, '!');
-		pcoflo = 0;
-		PIE3bits.TX2IE = 1;
-	} else if (pcbuf_r != pcbuf_w) {
-		c = pcbuf[pcbuf_r++];
-		SERIAL_TX(2, c);
-		PIE3bits.TX2IE = 1;
-	} else {
-		PIE3bits.TX2IE = 0;
+	INTCONbits.GIEL = 0;
+	job_left = 0;
+	INTCONbits.GIEL = 1;
+	job_on = 0;
+	job_end = 0;
+	job_idle = 0;
+}
+
+/* From USBEcho() */
+static const char * const job_why[] = {
+	"", "done", "idle", "eot", "eot blank"
+};
+
+static void
+job_poll(void)
+{
+	uint32_t now, idle;
+
+	if (!job_on) {
+		if ((eot_idle == 0 && eot_blank == 0) ||
+		    (rate_cur == 0 && !pmode))
+			return;
+		job_arm();
+	}
+	if (job_end == 0) {
+		now = ticks();
+		idle = job_idle ? job_idle : eot_idle;
+		/* capq_drain() has just run, so watch capq_w move too */
+		if (idle == 0 || (rate_cur == 0 && !pmode) ||
+		    job_seen != capq_w || capq_r != capq_w) {
+			job_seen = capq_w;
+			job_last = now;
+			return;
+		}
+		if (now - job_last < idle)
+			return;
+		job_end = job_idle ? JOB_IDLE : JOB_EOT;
 	}
-	// INTCON = 0xc0;
+	rate_halt();
+	pace_stop();
+	if (capq_r != capq_w || !outroom() || line_busy())
+		return;			// Let the tail go out first
+	putflush();
+	Send();				// Don't wait for the next round
+	sprintf(line, "\r\njob %s, %lu characters, tape %lu crc32 %08lx\r\n",
+	    job_why[job_end], job_count, tape_len, ~tape_crc);
+	puttext(line);
+	job_cancel();
+	tape_run = 0;
 }
 
-void
-putchar(char c) __wparam
+/* Report count and CRC-32 when the transport stops, from USBEcho() */
+static void
+tape_report(const char *why)
+{
+
+	sprintf(line, "\r\n%s, tape %lu characters crc32 %08lx\r\n",
+	    why, tape_len, ~tape_crc);
+	puttext(line);
+}
+
+/* Between tapes in capq: report the old one, then start counting over */
+static void
+tape_turn(uint8_t report)
 {
-	volatile uint8_t i;
 
-	// INTCON = 0x00;
-	i = pcbuf_w;
-	if (i + 1 == pcbuf_r) 
-		pcoflo = 1;
-	if (!pcoflo) {
-		pcbuf[i] = c;
-		pcbuf_w = i + 1;
+	if (!tape_pend || capq_r != tape_mark)
+		return;
+	if (tape_old && report) {
+		if (!outroom() || line_busy())
+			return;
+		putflush();
+		tape_report("stop");
 	}
-	if (SERIAL_TXRDY(2)) 
-		pc_poll();
-	// INTCON = 0xc0;
+	tape_old = 0;
+	tape_crc = 0xffffffffUL;
+	tape_len = 0;
+	tape_pend = 0;
 }
 
-#endif
+static void
+tape_poll(void)
+{
 
-#include "usb.c"
+	if (rate_cur != 0 || pmode) {
+		tape_run = 1;
+		return;
+	}
+	if (!tape_run || capq_r != capq_w || !outroom() || line_busy())
+		return;
+	putflush();
+	tape_report("stop");
+	tape_run = 0;
+}
 
-/*********************************************************************/
-static uint8_t txBuffer[64];
-static uint8_t txbp;
-static uint8_t rxBuffer[64];
-static uint8_t rxbp, rxbe;
-static uint8_t loop;
+/**********************************************************************
+ * USB throughput self test.
+ *
+ * 'X1' replaces the reader with a counting pattern (0x00, 0x01, ...)
+ * strobed by the rate timer, so speed commands and ramps apply as
+ * usual.  'X2' stops the timer and feeds the pattern to the encoder as
+ * fast as EP1 drains.  'X0' stops the test and reports what got
+ * through Send(), once the tail is out.  Use binary mode and
+ * host/xcheck to verify the pattern.
+ */
 
-static uint8_t hmode;
+static uint8_t xdone;			// Report pending
+static uint32_t xt0, xticks;		// Start and duration, T0 ticks
+static uint32_t xbytes, xpkts;
 
-static uint16_t rate;
+static void
+xtest(uint8_t m)
+{
 
-static const uint8_t hex[16] = {
-	'0', '1', '2', '3', '4', '5', '6', '7',
-	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
-};
+	rate_halt();
+	pace_stop();
+	if (m == 0) {
+		if (xmode) {
+			xticks = ticks() - xt0;
+			xbytes = tx_bytes;
+			xpkts = tx_pkts;
+			xdone = 1;
+		}
+		xmode = 0;
+		return;
+	}
+	capq_r = capq_w = 0;
+	xpat = 0;
+	tx_bytes = 0;
+	tx_pkts = 0;
+	xt0 = ticks();
+	xdone = 0;
+	xmode = m > XMODE_FLAT ? XMODE_FLAT : m;
+}
 
-/* XXX: move buff er insertion after strobe timing ? */
+/* From USBEcho() */
 static void
-dochar(void)
+xtest_poll(void)
 {
-	uint8_t c, u;
+	uint32_t ms, bps;
+	uint16_t ppf;
 
-	if (txbp + 1 + hmode * 3 > sizeof txBuffer) 
+	if (xmode == XMODE_FLAT) {
+		while (outroom())
+			putcap(xpat++);
 		return;
+	}
+	if (!xdone || capq_r != capq_w || !outroom() || line_busy())
+		return;
+	putflush();
+	ms = T0MS(xticks);
+	if (ms == 0)
+		ms = 1;
+	bps = xbytes / ms * 1000UL + (xbytes % ms) * 1000UL / ms;
+	/* 1ms frames */
+	ppf = (uint16_t)(xpkts / ms * 100UL + (xpkts % ms) * 100UL / ms);
+	sprintf(line, "\r\ntest %lu bytes %lu packets %lu ms,"
+	    " %lu B/s, %u.%02u packets/frame\r\n",
+	    xbytes, xpkts, ms, bps, ppf / 100, ppf % 100);
+	puttext(line);
+	xdone = 0;
+}
 
-	if (!PORTCbits.RC7)
+/*
+ * Change encoding, after finishing what the old one had going.  That
+ * takes room in txBuffer, so the change waits in hmode_next, and
+ * outroom() holds up everything else until setmode_poll() is done.
+ */
+static void
+setmode(uint8_t m)
+{
+
+	hmode_next = m;
+}
+
+static void
+setmode_poll(void)
+{
+	uint8_t m = hmode_next;
+
+	if (m == HMODE_NONE)
+		return;
+	hmode_next = HMODE_NONE;
+	if (!outroom()) {
+		hmode_next = m;
 		return;
+	}
+	putflush();
+	hmode = m;
+	ocol = 0;
+	b64n = 0;
+	ooff = 0;
+}
+
+/**********************************************************************
+ * Settings saved in flash with 'W' and restored at boot.  The saved
+ * rate is started when the host raises DTR.
+ */
+
+struct cfg {
+	uint32_t	cf_rate;
+	uint16_t	cf_pace_min;
+	uint8_t		cf_hmode;
+	uint8_t		cf_fmode;
+	uint8_t		cf_tmode;
+	uint8_t		cf_ramp_len;
+	uint8_t		cf_eot_idle;
+	uint8_t		cf_eot_blank;
+};
+
+CTASSERT(sizeof(struct cfg) + 3 <= FLASH_BLOCK);
+
+static uint32_t cfg_rate;
+static uint8_t dtr;
+
+static void
+cfg_save(void)
+{
+	struct cfg c;
+
+	c.cf_rate = rate;
+	c.cf_pace_min = pace_min;
+	c.cf_hmode = hmode_next != HMODE_NONE ? hmode_next : hmode;
+	c.cf_fmode = fmode;
+	c.cf_tmode = tmode;
+	c.cf_ramp_len = ramp_len;
+	c.cf_eot_idle = eot_arg;
+	c.cf_eot_blank = eot_blank;
+	flash_save((uint8_t *)&c, sizeof c);
+	cfg_rate = rate;
+}
+
+static void
+cfg_load(void)
+{
+	struct cfg c;
 
-	if ((CDC_modem & 3) != 3)		/* DTR + RTS */
+	if (!flash_load((uint8_t *)&c, sizeof c))
 		return;
+	cfg_rate = c.cf_rate;
+	pace_min = c.cf_pace_min;
+	if (c.cf_hmode < sizeof ocost)
+		hmode = c.cf_hmode;
+	fmode = c.cf_fmode;
+#if TEE
+	if (c.cf_tmode <= TEE_ONLY)
+		tmode = c.cf_tmode;
+#endif
+	ramp_len = c.cf_ramp_len;
+	eot_set(c.cf_eot_idle);
+	eot_blank = c.cf_eot_blank;
+}
 
-	c = PORTB;
-	/* XXX: validation read, to check PORTB bits are stable ? */
-	PORTCbits.RC6 = 0;
-	for (u = 0; u < 10; u++)
-		if(!PORTCbits.RC7)
-			break;
-	if (hmode) {
-		txBuffer[txbp++] = hex[((c & 0xf0) >> 4)];
-		txBuffer[txbp++] = hex[(c & 0xf)];
-		txBuffer[txbp++] = '\r';
-		txBuffer[txbp++] = '\n';
-	} else {
-		txBuffer[txbp++] = c;
+#if HOLD
+/**********************************************************************
+ * Hold and resume.
+ *
+ * When DTR drops in the middle of a capture, the capture is held
+ * rather than thrown away:  the transport stops, capq, txBuffer and
+ * the text queue keep what they have, and nothing more is handed to
+ * EP1 until a host asks for it.  A bus reset drops DTR too.
+ *
+ * 'Z' and four bytes, least significant first, asks for the stream
+ * from that offset on.  If it is still in hist[] the reply is
+ *
+ *	ESC 'Z' [offset] [~offset]
+ *
+ * followed by the bytes from offset on, without gaps or duplicates,
+ * and a held capture starts again as it was.  Anything still in the
+ * EP1 queue from before arrives ahead of the reply, the host skips
+ * to it.  Otherwise, or in framed and iso modes, the reply is
+ *
+ *	ESC 'z' [oldest offset kept] [next offset]
+ *
+ * and nothing changes, so 'Z' with 0xffffffff finds where the stream
+ * is.  Any other command drops a held capture, as DTR used to.
+ */
+
+static uint32_t held_rate;		// Rate target when it was held
+static uint8_t held_pmode;
+static uint32_t rs_arg;			// 'Z' argument being assembled
+static uint8_t rs_argn;
+
+/* Lose what there is, as a DTR drop always did */
+static void
+capture_drop(void)
+{
+
+	held = 0;
+	txbp = 0;
+	txq_r = txq_w;
+	rate_set(0);
+	pace_stop();
+	job_cancel();
+	xmode = 0;
+}
+
+static void
+capture_hold(void)
+{
+
+	if (xmode || (rate == 0 && rate_cur == 0 && !pmode && !job_on &&
+	    txbp == 0 && txq_r == txq_w && capq_r == capq_w)) {
+		capture_drop();
+		return;
 	}
-	/* XXX: calibrate width of strobe pulse */
-	for (u = 0; u < 30; u++)		/* 41.6 miuroseconds */
-		;
-	PORTCbits.RC6 = 1;
+	held_rate = rate;
+	held_pmode = pmode;
+	rate_set(0);
+	pace_stop();
+	held = 1;
 }
 
-static const char usage[] =
-	"\r\n\n"
-	"RC-2000 USB adapter\r\n"
-	"===================\r\n"
-	"0:\tSingle Step\r\n"
-	"1-9:\tSet Speed\r\n"
-	"+:\tFaster\r\n"
-	"-:\tSlower\r\n"
-	"b:\tBinary mode\r\n"
-	"h:\tHex mode\r\n"
-	"?:\tThis help\r\n"
-	"\n"
-	"2010-02-20 Poul-Henning Kamp\r\n"
-	"\n";
+static void
+rs_put32(uint8_t *p, uint32_t v)
+{
+
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
 
 static void
-Send(void)
+capture_resume(uint32_t off)
 {
-	uint8_t j;
 
-	j = InPipe(1, txBuffer, txbp);
-	if (j == 0) {
-	} else if (j == txbp) {
-		txbp = 0;
-	} else {
-		printf("Sent %u/%u\n\r", (uint16_t)j, (uint16_t)txbp);
-		txbp = 0;
+	if (RESUMING())
+		return;				// Host will ask again
+	rs_hdr[0] = 0x1b;
+	if (fmode || isoAlt || tx_off - off > hist_n) {
+		rs_hdr[1] = 'z';
+		rs_put32(rs_hdr + 2, tx_off - hist_n);
+		rs_put32(rs_hdr + 6, tx_off);
+		rs_n = RS_HDR;
+		return;
+	}
+	rs_hdr[1] = 'Z';
+	rs_put32(rs_hdr + 2, off);
+	rs_put32(rs_hdr + 6, ~off);
+	rs_n = RS_HDR;
+	rs_off = off;
+	rs_end = tx_off;
+	if (!held)
+		return;
+	held = 0;
+	if (job_end != 0)
+		return;				// Ended while it was held
+	if (held_pmode)
+		pace_go();
+	else if (held_rate != 0)
+		rate_set(held_rate);
+	/* It is the same tape, carry on counting */
+	tape_pend = 0;
+	tape_old = 0;
+	tape_run = 1;
+}
+#endif
+
+static void
+docmd(uint8_t j)
+{
+	uint32_t r;
+
+#if FRAMED
+	if (cmdarg == 'R') {
+		cmdarg = 0;
+		frame_request(j);
+		return;
+	}
+#endif
+	if (cmdarg == 'A') {
+		cmdarg = 0;
+		ramp_len = j;
+		printf("Ramp = %u\n\r", (uint16_t)ramp_len);
+		return;
+	}
+	if (cmdarg == 'M') {
+		cmdarg = 0;
+		pace_min = PACE_TICKS(j * 10UL);
+		printf("Min = %u\n\r", pace_min);
+		return;
+	}
+	if (cmdarg == 'N') {
+		job_arg |= (uint32_t)j << (8 * job_argn);
+		if (++job_argn < 3)
+			return;
+		cmdarg = 0;
+		INTCONbits.GIEL = 0;
+		job_left = job_arg;
+		INTCONbits.GIEL = 1;
+		job_arm();
+		printf("Job = %lu\n\r", job_arg);
+		return;
+	}
+	if (cmdarg == 'E') {
+		cmdarg = 0;
+		eot_set(j);
+		printf("EOT idle = %u\n\r", (uint16_t)j);
+		return;
+	}
+	if (cmdarg == 'B') {
+		cmdarg = 0;
+		eot_blank = j;
+		printf("EOT blanks = %u\n\r", (uint16_t)j);
+		return;
+	}
+	if (cmdarg == 'X') {
+		cmdarg = 0;
+		xtest(j >= '0' ? j - '0' : j);
+		return;
+	}
+#if HOLD
+	if (cmdarg == 'Z') {
+		rs_arg |= (uint32_t)j << (8 * rs_argn);
+		if (++rs_argn < 4)
+			return;
+		cmdarg = 0;
+		capture_resume(rs_arg);
+		return;
+	}
+	if (held && j != 'Z')
+		capture_drop();
+#endif
+	if (cmdarg == 'U') {
+		cmdarg = 0;
+		job_idle = j * (T0HZ / 100UL);
+		job_arm();
+		printf("Idle = %u\n\r", (uint16_t)j);
+		return;
+	}
+	printf("%c", j);
+	// if (txbp < sizeof txBuffer) txBuffer[txbp++] = j;
+	if ((j >= '0' && j <= '9') || j == '+' || j == '-')
+		pace_stop();
+	switch (j) {
+	case 'b':
+		setmode(HMODE_BIN);
+		break;
+	case 'h':
+		setmode(HMODE_HEX);
+		break;
+	case 'd':
+		setmode(HMODE_DUMP16);
+		break;
+	case 'D':
+		setmode(HMODE_DUMP32);
+		break;
+	case 'e':
+		setmode(HMODE_B64);
+		break;
+#if FRAMED
+	case 'f':
+		Send();
+		fmode = !fmode;
+		frame_init();
+		break;
+	case 'R':
+		cmdarg = j;
+		break;
+#endif
+#if TEE
+	case 't':
+		if (++tmode > TEE_ONLY)
+			tmode = TEE_OFF;
+		printf("Tee = %u\n\r", (uint16_t)tmode);
+		break;
+#endif
+	case '0':
+		rate_halt();
+		dochar();
+		break;
+	case '1': case '2': case '3': case '4': case '5':
+	case '6': case '7': case '8': case '9':
+		rate_set(speeds[j - '1']);
+		break;
+	case 'm':
+		rate_halt();
+		pace_start();
+		break;
+	case 'A':
+		cmdarg = j;
+		break;
+	case 'W':
+		cfg_save();
+		printf("Saved\n\r");
+		break;
+	case 'M':
+		cmdarg = j;
+		break;
+	case 'N':
+		job_arg = 0;
+		job_argn = 0;
+		cmdarg = j;
+		break;
+#if HOLD
+	case 'Z':
+		rs_arg = 0;
+		rs_argn = 0;
+		cmdarg = j;
+		break;
+#endif
+	case 'U':
+	case 'E':
+	case 'B':
+	case 'X':
+		cmdarg = j;
+		break;
+	case '-':
+		r = rate + (rate >> 4);
+		if (r > rate && r <= RATE_MAX)
+			rate_set(r);
+		else
+			rate_set(0);
+		break;
+	case '+':
+		if (rate == 0)
+			rate_set(RATE_MAX);
+		else {
+			r = rate - (rate >> 4);
+			if (r >= RATE_MIN)
+				rate_set(r);
+		}
+		break;
+	case '?':
+		puttext(usage);
+		break;
+	case 'T':
+		if (line_busy())
+			break;
+		sprintf(line,
+		    "attach %lu default %lu address %lu configured %lu"
+		    " ms, rcon %02x\r\n",
+		    T0MS(boot_ts[ATTACHED]), T0MS(boot_ts[DEFAULT]),
+		    T0MS(boot_ts[ADDRESS]), T0MS(boot_ts[CONFIGURED]),
+		    (uint16_t)boot_rcon);
+		puttext(line);
+		break;
+#if PROFILE
+	case 'P':
+		prof_next = 0;
+		break;
+#endif
+	case 'C':
+		if (!line_busy())
+			tape_report("tape");
+		break;
+	case 'S':
+		if (line_busy())
+			break;
+		sprintf(line, "stack used %u of %u bytes\r\n",
+		    stack_used(), STACK_SZ);
+		puttext(line);
+		break;
+	default:
+		break;
 	}
+	printf("Rate = %lu cps\n\r", rate ? (T1HZ * 256UL) / rate : 0UL);
 }
 
 // Regardless of what the USB is up to, we check the USART to see
@@ -220,98 +1732,88 @@ Send(void)
 static void
 USBEcho(void)
 {
-	uint8_t j;
-	uint16_t x;
+	uint8_t usb;
 
 #if SERIAL
-	uint8_t rxByte;
-
-	if (serial_rxoerr(2)) {
-		serial_init(2);
-	}
-	if (serial_rxrdy(2)) {
-		rxByte = serial_rx(2);
-		if (txbp < sizeof txBuffer)
-			txBuffer[txbp++] = rxByte;
-	}
+	while (serial_rxrdy(2) && txbp < TXPKT)
+		txBuffer[txbp++] = serial_rx(2);
 #endif
-	if ((deviceState < CONFIGURED) || (UCONbits.SUSPND == 1)) 
+#if TEE
+	if (serial_rxrdy(2))
+		docmd(serial_rx(2));
+#endif
+	usb = (deviceState == CONFIGURED) && (UCONbits.SUSPND == 0);
+	if (!usb && tmode != TEE_ONLY) 
 		return;
 
-	if (!(CDC_modem & 1)) {		/* DTR */
+	if (usb && !(CDC_modem & 1) && tmode != TEE_ONLY) {	/* DTR */
+#if HOLD
+		if (dtr)
+			capture_hold();
+		else if (!held)
+			capture_drop();
+#else
 		txbp = 0;
-		rate = 0;
+		txq_r = txq_w;
+		rate_set(0);
+		pace_stop();
+		job_cancel();
+		xmode = 0;
+#endif
+		dtr = 0;
+	} else if (usb && !dtr) {
+		dtr = 1;
+#if HOLD
+		if (!held)
+#endif
+		if (cfg_rate && rate_cur == 0 && !pmode)
+			rate_set(cfg_rate);
 	}
 
-	x = TMR0L; 
-	x |= (TMR0H << 8);
-	if (rate > 0 && x > rate) {
-		TMR0H = 0;
-		TMR0L = 0;
-		dochar();
-	}
+	setmode_poll();
+#if HOLD
+	tape_turn(usb && dtr && !held);
+#else
+	tape_turn(usb && dtr);
+#endif
+	capq_drain();
+	job_poll();
+	if (!usb)
+		return;
+#if HOLD
+	if (dtr && !held)
+#else
+	if (dtr)
+#endif
+		tape_poll();
+	xtest_poll();
+	txq_pump();
+#if PROFILE
+	if (prof_next < PROF_N && !line_busy())
+		prof_report();
+#endif
 	loop++;
-	if (txbp == 64) 
+	if (TXFULL() || (isoAlt && txbp > 0))	// Iso: every frame
+		Send();
+#if FRAMED
+	else if (fmode && (frame_built || frame_rsr != frame_rsw))
+		Send();				// Last frame, or resends
+#endif
+#if HOLD
+	else if (RESUMING())
 		Send();
+#endif
 
 	if (loop)
 		return;
 
+	if (rate_cur == 0 && !pmode && capq_r == capq_w && outroom())
+		putflush();
 	if (txbp > 0) 
 		Send();
 
 	if (rxbp < rxbe) {
-		j = rxBuffer[rxbp];
-		printf("%c", j);
-		// if (txbp < sizeof txBuffer) txBuffer[txbp++] = j;
-		switch (j) {
-		case 'b':
-			hmode = 0;
-			break;
-		case 'h':
-			hmode = 1;
-			break;
-		case '0':
-			rate = 0;
-			dochar();
-			break;
-#define T0HZ	750000UL
-		case '1': rate = 15000; break;	// 50 cps
-		case '2': rate =  7500; break;	// 100 cps
-		case '3': rate =  3750; break;	// 200 cps
-		case '4': rate =  1500; break;	// 380 cps
-		case '5': rate =   750; break;	// 718 cps
-		case '6': rate =   600; break;	// 1034 cps
-		case '7': rate =   400; break;	// 1411 cps
-		case '8': rate =   300; break;	// 1780 cps
-		case '9': rate =    16; break;	// 2479 cps
-		case '-':
-			x = rate + (rate >> 4);
-			if (x > rate)
-				rate = x;
-			else
-				rate = 0;
-			break;
-		case '+':
-			if (rate == 0)
-				rate = 65500U;
-			else {
-				x = rate - (rate >> 4);
-				if (x < rate)
-					rate = x;
-			}
-			break;
-		case '?':
-			for (j = 0; j < sizeof usage; j++) {
-				txBuffer[txbp++] = usage[j];
-				while (txbp == sizeof txBuffer)
-					Send();
-			}
-			break;
-		default:
-			break;
-		}
-		printf("Rate = %u\n\r", rate);
+		docmd(rxBuffer[rxbp]);
 		rxbp++;
 	} else {
 		rxbe = OutPipe(1, rxBuffer, sizeof rxBuffer);
@@ -326,24 +1828,36 @@ intr_h() interrupt 1
 {
 	uint8_t u;
 
+	PROF_ENTER(PROF_INTR_H);
 	u = PIR2;
-	PORTBbits.RB4 = 1;
 	if (u & 0x10)
 		USB_intr();
-	PORTBbits.RB4 = 0;
-	PIR2 = 0;
-#if SERIAL
-	u = PIR3;
-	if (u & 0x10)
-		pc_poll();
-	PIR3 = 0;
+	PIR2bits.USBIF = 0;		// Not CCP2IF, pace_intr() needs it
+#if SERIAL || TEE
+	serial_intr();
 #endif
+#if TEE
+	if (INTCON3bits.INT1IE && INTCON3bits.INT1IF) {
+		INTCON3bits.INT1IE = 0;
+		INTCON3bits.INT1IF = 0;
+		serial_kick(2);
+	}
+#endif
+	PROF_EXIT(PROF_INTR_H);
 }
 
 void
 intr_l() interrupt 2
 {
 
+	PROF_ENTER(PROF_INTR_L);
+	if (INTCONbits.TMR0IF) {
+		INTCONbits.TMR0IF = 0;
+		t0hi++;
+	}
+	rate_intr();
+	pace_intr();
+	PROF_EXIT(PROF_INTR_L);
 }
 
 /*********************************************************************/
@@ -351,69 +1865,145 @@ intr_l() interrupt 2
 void
 main(void) wparam
 {
-	uint16_t u;
+
+	stack_paint();
+
+	/*
+	 * Start the uptime clock first, it also times the PLL lock.
+	 * T0 Freq = 48MHz / (4 * 256) = 46.875 kHz
+	 */
+	T0CON = 0
+	    | (1 << 7)		// Enable
+	    | (7 << 0)		// 1:256 Prescaler
+	    ;
+	INTCON2bits.TMR0IP = 0;
+	INTCONbits.TMR0IE = 1;
+	boot_rcon = RCON;
+	RCONbits.POR = 1;
+	RCONbits.BOR = 1;
+	RCONbits.RI = 1;
+
+	/*
+	 * The J50 has no PLL lock flag, wait out the oscillator start-up
+	 * timer and TPLL.  Before lock TMR0 runs slow, which errs on the
+	 * safe side.
+	 */
+	OSCTUNEbits.PLLEN = 1;
+	while (!OSCCONbits.OSTS || ticks() < PLL_TICKS)
+		;
+
+	// Attach to the USB as early as possible
+	UCFG = 0x14; // Enable pullup resistors; full speed mode
+	deviceState = DETACHED;
+	remoteWakeup = 0x00;
+	currentConfiguration = 0x00;
+
+	/* Setup Interrupts */
+	RCONbits.IPEN = 1;
+	INTCONbits.GIEH = 1;
+	INTCONbits.GIEL = 1;
+	PIE2bits.USBIE = 1;
+	EnableUSBModule();
 
 	TRISCbits.TRISC6 = 0;
 #if SERIAL
-	SERIAL_INIT(2);
-	SERIAL_BAUD(2, 103);		// 48MHz / (4 * (115200 + 1) = 104
-	TXSTA2bits.BRGH = 1;
-	BAUDCON2bits.BRG16 = 1;
-
 	// stdin = STREAM_USART;
 	// stdout = STREAM_USART;
 	TRISAbits.TRISA0 = 0;
 	RPOR0 = 5;			// RP0 = RA0 = pin2 = TX
 	RPINR16 = 1; 			// RP1 = RA1 = pin3 = RX
+	serial_init(2, SERIAL_BRG(115200UL));	// 48MHz / (4 * 115200) - 1 = 103
 
+#endif
+#if TEE
+	TRISAbits.TRISA0 = 0;
+	TRISCbits.TRISC2 = 0;
+	RPOR0 = 5;			// RP0 = RA0 = pin2 = TX
+	RPINR16 = 1; 			// RP1 = RA1 = pin3 = RX
+	RPINR1 = 12;			// RP12 = RC1 = pin12 = CTS# -> INT1
+	INTCON2bits.INTEDG1 = 0;	// CTS# asserts on falling edge
+	serial_init(2, SERIAL_BRG(TEE_BAUD));
+	tmode = TEE_OFF;
 #endif
 	stdin = STREAM_USER;
 	stdout = STREAM_USER;
 
-
-	OSCTUNEbits.PLLEN = 1;
-	/* Wait for PLL to lock */
-	for (u = 0; u < 0x8000; u++)
-		;
-
-
 	// Set all I/O pins to digital
 	ANCON0 |= 0x00;
 	ANCON1 |= 0x1F;
 
 	/*
-	 * T0 Freq = 48MHz / (4 * 16) = 750 kHz
+	 * T1 Freq = 48MHz / (4 * 8) = 1.5 MHz, reset by CCP1 for the rate
 	 */
-	T0CON = 0
-	    | (1 << 7)		// Enable
-	    | (3 << 0)		// 1:16 Prescaler
+	T1CON = 0
+	    | (3 << 4)		// 1:8 Prescaler
+	    | (1 << 1)		// RD16
+	    | (1 << 0)		// Enable
 	    ;
+	CCP1CON = 0x0b;		// Compare, special event trigger
+	IPR1bits.CCP1IP = 0;
 
-	// Initialize USB
-	UCFG = 0x14; // Enable pullup resistors; full speed mode
-	deviceState = DETACHED;
-	remoteWakeup = 0x00;
-	currentConfiguration = 0x00;
+	/*
+	 * T3 Freq = 48MHz / (4 * 8) = 1.5 MHz, for CCP2 pacing
+	 */
+	T3CON = 0
+	    | (3 << 4)		// 1:8 Prescaler
+	    | (1 << 1)		// RD16
+	    | (1 << 0)		// Enable
+	    ;
+	TCLKCON = 0x01;		// CCP1 on T1, CCP2 on T3
+	CCP2CON = 0x0a;		// Compare, software interrupt only
+	IPR2bits.CCP2IP = 0;
 
-	INTCON2bits.RBPU = 0;		// Weak pull-up PORTB
+	/* RC7 (ready) rising edge -> INT2, low priority */
+	RPINR2 = 18;		// RP18 = RC7
+	INTCON2bits.INTEDG2 = 1;
+	INTCON3bits.INT2IP = 0;
+	pace_min = PACE_TICKS(PACE_MIN_US);
+	pmode = 0;
 
-	/* Setup Interrupts */
-	RCONbits.IPEN = 1;
-	INTCON = 0xc0;
-	PIE2bits.USBIE = 1;
+	INTCON2bits.RBPU = 0;		// Weak pull-up PORTB
 
 
-	rate = 0;
+	ramp_len = RAMP_LEN;
+	rate_halt();
 	txbp = 0;
 	rxbp = 0;
 	rxbe = 0;
-	hmode = 1;
+	hmode = HMODE_HEX;
+	ocol = 0;
+	b64n = 0;
+	fmode = 0;
+	cmdarg = 0;
+	txq_r = txq_w = 0;
+	job_left = 0;
+	job_cancel();
+	tape_start();
+	tape_run = 0;
+	xmode = 0;
+	xdone = 0;
+	eot_set(0);
+	eot_blank = 0;
+#if PROFILE
+	memset(prof, 0, sizeof prof);
+	prof_next = PROF_N;
+#endif
+	cfg_rate = 0;
+	dtr = 0;
+	cfg_load();
+#if TEE
+	if (tmode == TEE_ONLY && cfg_rate)
+		rate_set(cfg_rate);
+#endif
 
 	while(1) {
 		ClrWdt();
 		// Ensure USB module is available
 		EnableUSBModule();
+		USB_task();
+		PROF_ENTER(PROF_ECHO);
 		USBEcho();
+		PROF_EXIT(PROF_ECHO);
 	}
 }
 
@@ -30,6 +30,46 @@
 #ifndef __SERIAL_C__
 #define __SERIAL_C__
 
+#include <string.h>
+
+/*
+ * Ring sizes, must be powers of two no larger than 256.
+ */
+#ifndef SERIAL_RXSZ
+#define SERIAL_RXSZ	32
+#endif
+#ifndef SERIAL_TXSZ
+#define SERIAL_TXSZ	128
+#endif
+
+CTASSERT(SERIAL_RXSZ <= 256 && (SERIAL_RXSZ & (SERIAL_RXSZ - 1)) == 0);
+CTASSERT(SERIAL_TXSZ <= 256 && (SERIAL_TXSZ & (SERIAL_TXSZ - 1)) == 0);
+
+/*
+ * Optional hardware handshake, the EUSART has none of its own.
+ * SERIAL_CTSn is true when the far end will accept data, SERIAL_CTSWAITn
+ * must arrange for serial_kick(n) to be called when it becomes true.
+ * SERIAL_RTSn(x) asserts (x = 1) or drops our own request to send.
+ */
+#ifndef SERIAL_CTS
+#define SERIAL_CTS		1
+#define SERIAL_CTSWAIT		do { } while (0)
+#define SERIAL_RTS(x)		do { } while (0)
+#endif
+#ifndef SERIAL_CTS1
+#define SERIAL_CTS1		1
+#define SERIAL_CTSWAIT1		do { } while (0)
+#define SERIAL_RTS1(x)		do { } while (0)
+#endif
+#ifndef SERIAL_CTS2
+#define SERIAL_CTS2		1
+#define SERIAL_CTSWAIT2		do { } while (0)
+#define SERIAL_RTS2(x)		do { } while (0)
+#endif
+
+/* Drop RTS when the receive ring has less room than this */
+#define SERIAL_RXHIWAT		(SERIAL_RXSZ / 4)
+
 #define __RCPIR  (PIR1bits.RC1IF)
 #define __RCPIR1 (PIR1bits.RC1IF)
 #define __RCPIR2 (PIR3bits.RC2IF)
@@ -38,6 +78,14 @@
 #define __TXPIR1 (PIR1bits.TX1IF)
 #define __TXPIR2 (PIR3bits.TX2IF)
 
+#define __RCPIE  (PIE1bits.RC1IE)
+#define __RCPIE1 (PIE1bits.RC1IE)
+#define __RCPIE2 (PIE3bits.RC2IE)
+
+#define __TXPIE	(PIE1bits.TX1IE)
+#define __TXPIE1 (PIE1bits.TX1IE)
+#define __TXPIE2 (PIE3bits.TX2IE)
+
 /* --------------------------------------------------------------------
  */
 
@@ -56,6 +104,21 @@
 
 #define SERIAL_BAUD(port, baud) do { SPBRG ## port = baud; } while (0)
 
+/*
+ * BRG16 + BRGH: baud = Fosc / (4 * (brg + 1)), which at 48MHz
+ * reaches 3 Mbaud (brg = 3) and is exact at 1, 1.5, 2 and 3 Mbaud.
+ */
+#define SERIAL_BRG(baud)	\
+	((MHZ * 1000000UL / 4 + (baud) / 2) / (baud) - 1)
+
+#define SERIAL_BAUD16(port, brg)					\
+	do {								\
+		BAUDCON ## port ## bits.BRG16 = 1;			\
+		TXSTA ## port ## bits.BRGH = 1;				\
+		SPBRGH ## port = (uint16_t)(brg) >> 8;			\
+		SPBRG ## port = (brg) & 0xff;				\
+	} while (0)
+
 #define SERIAL_TXRDY(port) 	(TXSTA ## port ## bits.TRMT)
 
 #define SERIAL_TX(port, byte) 	do { TXREG ## port = byte; } while (0)
@@ -68,56 +131,205 @@
 
 #define IF_PORT(m, n)	if ((SERIALPORTS & (1 << n)) && m == n)
 
+/* --------------------------------------------------------------------
+ * Interrupt driven rings.
+ *
+ * There is a single producer and a single consumer for each ring
+ * and the indices are bytes, so the interrupt handler and the main
+ * loop can share them without locking.  Transmitters in the main
+ * loop can race the DBG() output from the USB interrupt, so
+ * serial_tx() blocks the high priority interrupt.
+ */
+
+struct serial_port {
+	volatile uint8_t	rx_rd;
+	volatile uint8_t	rx_wr;
+	volatile uint8_t	tx_rd;
+	volatile uint8_t	tx_wr;
+	uint16_t		rx_oerr;	// Hardware overruns
+	uint16_t		rx_ferr;	// Framing errors
+	uint16_t		rx_ovfl;	// RX ring full
+	uint16_t		tx_ovfl;	// TX ring full
+	uint8_t			rxbuf[SERIAL_RXSZ];
+	uint8_t			txbuf[SERIAL_TXSZ];
+};
+
+#if SERIALPORTS & (1 << 0)
+static struct serial_port serial_port0;
+#define __SP0	(&serial_port0)
+#else
+#define __SP0	((struct serial_port *)0)
+#endif
+
+#if SERIALPORTS & (1 << 1)
+static struct serial_port serial_port1;
+#define __SP1	(&serial_port1)
+#else
+#define __SP1	((struct serial_port *)0)
+#endif
+
+#if SERIALPORTS & (1 << 2)
+static struct serial_port serial_port2;
+#define __SP2	(&serial_port2)
+#else
+#define __SP2	((struct serial_port *)0)
+#endif
+
+#define SERIAL_INTR(port, sp)						\
+	do {								\
+		uint8_t __c, __i;					\
+		while (__RCPIR ## port) {				\
+			if (RCSTA ## port ## bits.FERR)			\
+				sp->rx_ferr++;				\
+			__c = RCREG ## port;				\
+			__i = (sp->rx_wr + 1) & (SERIAL_RXSZ - 1);	\
+			if (__i == sp->rx_rd) {				\
+				sp->rx_ovfl++;				\
+			} else {					\
+				sp->rxbuf[sp->rx_wr] = __c;		\
+				sp->rx_wr = __i;			\
+			}						\
+			if (((sp->rx_rd - __i) & (SERIAL_RXSZ - 1)) <	\
+			    SERIAL_RXHIWAT)				\
+				SERIAL_RTS ## port(0);			\
+		}							\
+		if (SERIAL_RXOERR(port)) {				\
+			sp->rx_oerr++;					\
+			RCSTA ## port ## bits.CREN = 0;			\
+			RCSTA ## port ## bits.CREN = 1;			\
+		}							\
+		if (__TXPIE ## port) {					\
+			while (__TXPIR ## port &&			\
+			    sp->tx_rd != sp->tx_wr) {			\
+				if (!(SERIAL_CTS ## port)) {		\
+					__TXPIE ## port = 0;		\
+					SERIAL_CTSWAIT ## port;		\
+					break;				\
+				}					\
+				__i = sp->tx_rd;			\
+				TXREG ## port = sp->txbuf[__i];		\
+				sp->tx_rd = (__i + 1) & (SERIAL_TXSZ - 1); \
+			}						\
+			if (sp->tx_rd == sp->tx_wr)			\
+				__TXPIE ## port = 0;			\
+		}							\
+	} while (0)
+
+static struct serial_port *
+serial_port(const uint8_t port)
+{
+	IF_PORT(port, 0)	return(__SP0);
+	IF_PORT(port, 1)	return(__SP1);
+	IF_PORT(port, 2)	return(__SP2);
+	return (0);
+}
+
+/*
+ * Call from the interrupt handler whenever PIR1 or PIR3 flags a UART.
+ */
 static void
-serial_init(const uint8_t port)
+serial_intr(void)
 {
-	IF_PORT(port, 0)	SERIAL_INIT();
-	IF_PORT(port, 1)	SERIAL_INIT(1);
-	IF_PORT(port, 2)	SERIAL_INIT(2);
+	if (SERIALPORTS & (1 << 0))	SERIAL_INTR(, __SP0);
+	if (SERIALPORTS & (1 << 1))	SERIAL_INTR(1, __SP1);
+	if (SERIALPORTS & (1 << 2))	SERIAL_INTR(2, __SP2);
 }
 
+static void
+serial_init(const uint8_t port, const uint16_t brg)
+{
+	struct serial_port *sp = serial_port(port);
+
+	IF_PORT(port, 0)	{ __RCPIE = 0; __TXPIE = 0; }
+	IF_PORT(port, 1)	{ __RCPIE1 = 0; __TXPIE1 = 0; }
+	IF_PORT(port, 2)	{ __RCPIE2 = 0; __TXPIE2 = 0; }
+	memset(sp, 0, sizeof *sp);
+	IF_PORT(port, 0)	{ SERIAL_INIT(); SERIAL_BAUD16(, brg); }
+	IF_PORT(port, 1)	{ SERIAL_INIT(1); SERIAL_BAUD16(1, brg); }
+	IF_PORT(port, 2)	{ SERIAL_INIT(2); SERIAL_BAUD16(2, brg); }
+	IF_PORT(port, 0)	{ SERIAL_RTS(1); __RCPIE = 1; }
+	IF_PORT(port, 1)	{ SERIAL_RTS1(1); __RCPIE1 = 1; }
+	IF_PORT(port, 2)	{ SERIAL_RTS2(1); __RCPIE2 = 1; }
+}
+
+/*
+ * Restart a transmitter which stalled on CTS.
+ */
+static void
+serial_kick(const uint8_t port)
+{
+	struct serial_port *sp = serial_port(port);
+
+	if (sp->tx_rd == sp->tx_wr)
+		return;
+	IF_PORT(port, 0)	__TXPIE = 1;
+	IF_PORT(port, 1)	__TXPIE1 = 1;
+	IF_PORT(port, 2)	__TXPIE2 = 1;
+}
+
+/* Room in the transmit ring */
 static uint8_t
 serial_txrdy(const uint8_t port)
 {
-	IF_PORT(port, 0)	return(__TXPIR);
-	IF_PORT(port, 1)	return(__TXPIR1);
-	IF_PORT(port, 2)	return(__TXPIR2);
-	return (0);
+	struct serial_port *sp = serial_port(port);
+
+	return ((sp->tx_rd - sp->tx_wr - 1) & (SERIAL_TXSZ - 1));
 }
 
 static void
 serial_tx(const uint8_t port, const uint8_t byte)
 {
-	IF_PORT(port, 0)	SERIAL_TX(, byte);
-	IF_PORT(port, 1)	SERIAL_TX(1, byte);
-	IF_PORT(port, 2)	SERIAL_TX(2, byte);
+	struct serial_port *sp = serial_port(port);
+	uint8_t i, s;
+
+	s = INTCON & 0x80;
+	INTCONbits.GIEH = 0;
+	i = (sp->tx_wr + 1) & (SERIAL_TXSZ - 1);
+	if (i == sp->tx_rd) {
+		sp->tx_ovfl++;
+	} else {
+		sp->txbuf[sp->tx_wr] = byte;
+		sp->tx_wr = i;
+		IF_PORT(port, 0)	__TXPIE = 1;
+		IF_PORT(port, 1)	__TXPIE1 = 1;
+		IF_PORT(port, 2)	__TXPIE2 = 1;
+	}
+	INTCON |= s;
 }
 
-static uint8_t
+/* Hardware overruns since serial_init() */
+static uint16_t
 serial_rxoerr(const uint8_t port)
 {
-	IF_PORT(port, 0)	return(SERIAL_RXOERR());
-	IF_PORT(port, 1)	return(SERIAL_RXOERR(1));
-	IF_PORT(port, 2)	return(SERIAL_RXOERR(2));
-	return (0);
+	struct serial_port *sp = serial_port(port);
+
+	return (sp->rx_oerr);
 }
 
+/* Bytes waiting in the receive ring */
 static uint8_t
 serial_rxrdy(const uint8_t port)
 {
-	IF_PORT(port, 0)	return(SERIAL_RXRDY());
-	IF_PORT(port, 1)	return(SERIAL_RXRDY(1));
-	IF_PORT(port, 2)	return(SERIAL_RXRDY(2));
-	return (0);
+	struct serial_port *sp = serial_port(port);
+
+	return ((sp->rx_wr - sp->rx_rd) & (SERIAL_RXSZ - 1));
 }
 
 static uint8_t
 serial_rx(const uint8_t port)
 {
-	IF_PORT(port, 0)	return(SERIAL_RX());
-	IF_PORT(port, 1)	return(SERIAL_RX(1));
-	IF_PORT(port, 2)	return(SERIAL_RX(2));
-	return (0);
+	struct serial_port *sp = serial_port(port);
+	uint8_t c, i;
+
+	i = sp->rx_rd;
+	c = sp->rxbuf[i];
+	sp->rx_rd = (i + 1) & (SERIAL_RXSZ - 1);
+	if (((i - sp->rx_wr) & (SERIAL_RXSZ - 1)) >= SERIAL_RXHIWAT) {
+		IF_PORT(port, 0)	SERIAL_RTS(1);
+		IF_PORT(port, 1)	SERIAL_RTS1(1);
+		IF_PORT(port, 2)	SERIAL_RTS2(1);
+	}
+	return (c);
 }
 
 #endif /* __SERIAL_C__ */
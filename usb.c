@@ -64,7 +64,7 @@ uint8_t debugLevel = 127;
 // Global variables
 uint8_t deviceState;
 uint8_t remoteWakeup;
-static uint8_t deviceAddress;
+static volatile uint8_t deviceAddress;	// Set by SET_ADDRESS, see SetAddress()
 static uint8_t selfPowered;
 uint8_t currentConfiguration;
 
@@ -78,12 +78,23 @@ static uint8_t ctrlTransferStage; // Holds the current stage in a control transf
 static uint8_t requestHandled;    // Set to 1 if request was understood and processed.
 
 static const volatile uint8_t *outPtr;	// Data to send to the host
+static uint8_t outDirect;		// outPtr is USB RAM, send in place
 static volatile uint8_t *inPtr;		// Data from the host
 static uint16_t wCount;			// Number of bytes of data
 
+#ifndef USB_STATE_HOOK		/* Let the application timestamp states */
+#define USB_STATE_HOOK(state)	do { } while (0)
+#endif
+
+#ifndef USB_PROF_ENTER		/* Let the application profile handlers */
+#define USB_PROF_ENTER(what)	do { } while (0)
+#define USB_PROF_EXIT(what)	do { } while (0)
+#endif
+
 #define NewState(state)					\
 	do {						\
 		deviceState = state;			\
+		USB_STATE_HOOK(state);			\
 		DBG(DBUG_STA, "->" #state);		\
 	} while (0)
 
@@ -99,6 +110,53 @@ static uint16_t wCount;			// Number of bytes of data
 
 #define N_STRING (sizeof(stringDescriptors)/sizeof(stringDescriptors[0]))
 
+/***********************************************************************
+ * Descriptor images
+ *
+ * The descriptors are copied from flash into RAM once, when the USB
+ * module is enabled, so that GET_DESCRIPTOR can point the EP0 IN
+ * buffer descriptor straight at them, packet by packet, instead of
+ * copying through controlTransferBuffer in the interrupt.
+ */
+
+#define DESC_IMAGE_SZ	(sizeof deviceDescriptor +			\
+			 sizeof configDescriptor +			\
+			 sizeof stringDescriptor0 +			\
+			 sizeof stringDescriptor1 +			\
+			 sizeof stringDescriptor2 +			\
+			 sizeof stringDescriptor3)
+CTASSERT(N_STRING == 4);	// Update DESC_IMAGE_SZ
+
+static volatile uint8_t descImage[DESC_IMAGE_SZ];
+static volatile uint8_t *deviceImage;
+static volatile uint8_t *configImage;
+static volatile uint8_t *stringImage[N_STRING];
+
+static volatile uint8_t *
+DescriptorCopy(volatile uint8_t *dst, const uint8_t *src, uint8_t len)
+{
+
+	memcpy(dst, src, len);
+	return (dst + len);
+}
+
+static void
+DescriptorImages(void)
+{
+	volatile uint8_t *p = descImage;
+	uint8_t u;
+
+	deviceImage = p;
+	p = DescriptorCopy(p, deviceDescriptor, sizeof deviceDescriptor);
+	configImage = p;
+	p = DescriptorCopy(p, configDescriptor, sizeof configDescriptor);
+	for (u = 0; u < N_STRING; u++) {
+		stringImage[u] = p;
+		p = DescriptorCopy(p, stringDescriptors[u],
+		    *stringDescriptors[u]);
+	}
+}
+
 /***********************************************************************
  * Buffer Descriptors.
  */
@@ -109,64 +167,40 @@ struct BDT {
 	uint16_t	Addr;
 };
 
-volatile struct BDT __at(0x0400) BDTable[32];
+/*
+ * Only as many descriptor pairs as the highest endpoint in use
+ * needs, ping-pong buffering is off (UCFG.PPB = 0)
+ */
+#define EP_BIT(num, dir, attr, size, ival)	| (1U << (num))
+#define EP_MASK		(1U ENDPOINTS(EP_BIT))
+#define N_EP		(EP_MASK >= 0x100 ? 9 : EP_MASK >= 0x80 ? 8 :	\
+			 EP_MASK >= 0x40 ? 7 : EP_MASK >= 0x20 ? 6 :	\
+			 EP_MASK >= 0x10 ? 5 : EP_MASK >= 0x08 ? 4 :	\
+			 EP_MASK >= 0x04 ? 3 : EP_MASK >= 0x02 ? 2 : 1)
+CTASSERT(EP_MASK < 0x200);
+
+volatile struct BDT __at(0x0400) BDTable[2 * N_EP];
 #define BDTo(n)	(BDTable[0 + 2 * (n)])
 #define BDTi(n)	(BDTable[1 + 2 * (n)])
 
 /***********************************************************************
  * Pipe Buffers
- * Buffer sizes are set in usb_desc.c
- * XXX: 7 more pipes possible
+ * Exactly one buffer per endpoint in the tables in usb_desc.c
  */
 
 static volatile setupPacketStruct SetupPacket;
 static volatile uint8_t controlTransferBuffer[PIPE_0_SZ_OUT];
 
-#define QUIET(x) (x ? x : 1)	// Silence a silly compiler warning 
-
-static volatile uint8_t pipe_in_1[QUIET(PIPE_1_SZ_IN)];
-static volatile uint8_t pipe_in_2[QUIET(PIPE_2_SZ_IN)];
-static volatile uint8_t pipe_in_3[QUIET(PIPE_3_SZ_IN)];
-static volatile uint8_t pipe_in_4[QUIET(PIPE_4_SZ_IN)];
-static volatile uint8_t pipe_in_5[QUIET(PIPE_5_SZ_IN)];
-static volatile uint8_t pipe_in_6[QUIET(PIPE_6_SZ_IN)];
-static volatile uint8_t pipe_in_7[QUIET(PIPE_7_SZ_IN)];
-static volatile uint8_t pipe_in_8[QUIET(PIPE_8_SZ_IN)];
-
-static const volatile uint8_t * const pipe_in[] = {
-	0,
-	pipe_in_1, pipe_in_2, pipe_in_3, pipe_in_4,
-	pipe_in_5, pipe_in_6, pipe_in_7, pipe_in_8,
-};
-
-static const uint8_t pipe_in_len[] = {
-	0,
-	PIPE_1_SZ_IN, PIPE_2_SZ_IN, PIPE_3_SZ_IN, PIPE_4_SZ_IN,
-	PIPE_5_SZ_IN, PIPE_6_SZ_IN, PIPE_7_SZ_IN, PIPE_8_SZ_IN,
-};
-
-static volatile uint8_t pipe_out_1[QUIET(PIPE_1_SZ_OUT)];
-static volatile uint8_t pipe_out_2[QUIET(PIPE_2_SZ_OUT)];
-static volatile uint8_t pipe_out_3[QUIET(PIPE_3_SZ_OUT)];
-static volatile uint8_t pipe_out_4[QUIET(PIPE_4_SZ_OUT)];
-static volatile uint8_t pipe_out_5[QUIET(PIPE_5_SZ_OUT)];
-static volatile uint8_t pipe_out_6[QUIET(PIPE_6_SZ_OUT)];
-static volatile uint8_t pipe_out_7[QUIET(PIPE_7_SZ_OUT)];
-static volatile uint8_t pipe_out_8[QUIET(PIPE_8_SZ_OUT)];
-
-static const volatile uint8_t * const pipe_out[] = {
-	0,
-	pipe_out_1, pipe_out_2, pipe_out_3, pipe_out_4,
-	pipe_out_5, pipe_out_6, pipe_out_7, pipe_out_8,
-};
-
-static const uint8_t pipe_out_len[] = {
-	0,
-	PIPE_1_SZ_OUT, PIPE_2_SZ_OUT, PIPE_3_SZ_OUT, PIPE_4_SZ_OUT,
-	PIPE_5_SZ_OUT, PIPE_6_SZ_OUT, PIPE_7_SZ_OUT, PIPE_8_SZ_OUT,
-};
+#define EP_BUF(num, dir, attr, size, ival)				\
+	static volatile uint8_t ep##num##_##dir[EP_NBUF_##dir(num)][size];
+ENDPOINTS(EP_BUF)
+#undef EP_BUF
 
-#undef QUIET
+/* Filled in by InitPipes() for InPipe() and OutPipe() */
+static volatile uint8_t *pipe_in[N_EP];
+static uint8_t pipe_in_len[N_EP];
+static volatile uint8_t *pipe_out[N_EP];
+static uint8_t pipe_out_len[N_EP];
 
 /***********************************************************************/
 
@@ -181,6 +215,114 @@ __BDT_handover(uint8_t s) wparam
 
 #define BDT_handover(b) ((b).Stat = __BDT_handover((b).Stat))
 
+/***********************************************************************
+ * The queued pipe.
+ *
+ * qin_h counts packets queued by InPipe(), qin_t packets the SIE has
+ * sent; while they differ the SIE owns slot qin_t and the completion
+ * hands it the next one at once.  Likewise qout_h counts packets
+ * received, qout_t packets taken by OutPipe(), and the SIE is kept
+ * armed on the next free slot as long as there is one.  Main loop
+ * code masks USBIE around changes.
+ */
+
+#define QSLOT_IN(n)	(pipe_in[QPIPE] + ((n) % QPIPE_IN_N) * PIPE_1_SZ_IN)
+#define QSLOT_OUT(n)	(pipe_out[QPIPE] + ((n) % QPIPE_OUT_N) * PIPE_1_SZ_OUT)
+
+CTASSERT(QPIPE == 1);		// QSLOT_* use the PIPE_1 sizes
+CTASSERT((QPIPE_IN_N & (QPIPE_IN_N - 1)) == 0);	// n wraps at 256
+CTASSERT((QPIPE_OUT_N & (QPIPE_OUT_N - 1)) == 0);
+
+static volatile uint8_t qin_h, qin_t;
+static uint8_t qin_cnt[QPIPE_IN_N];
+static volatile uint8_t qout_h, qout_t;
+static uint8_t qout_cnt[QPIPE_OUT_N];
+static uint8_t qout_armed;
+
+static void
+QInStart(void)
+{
+
+	BDTi(QPIPE).Addr = PTR16(QSLOT_IN(qin_t));
+	BDTi(QPIPE).Cnt = qin_cnt[qin_t % QPIPE_IN_N];
+	BDT_handover(BDTi(QPIPE));
+}
+
+static void
+QOutArm(void)
+{
+
+	BDTo(QPIPE).Addr = PTR16(QSLOT_OUT(qout_h));
+	BDTo(QPIPE).Cnt = PIPE_1_SZ_OUT;
+	BDT_handover(BDTo(QPIPE));
+	qout_armed = 1;
+}
+
+static void
+QPipeInit(void)
+{
+
+	qin_h = qin_t = 0;
+	qout_h = qout_t = 0;
+	qout_armed = 1;		// InitPipes() armed slot 0
+}
+
+/* Transaction complete on QPIPE, from USB_intr() */
+static void
+QPipeDone(uint8_t in)
+{
+
+	if (in) {
+		if (qin_t == qin_h)
+			return;
+		qin_t++;
+		if (qin_t != qin_h)
+			QInStart();
+	} else {
+		qout_cnt[qout_h % QPIPE_OUT_N] = BDTo(QPIPE).Cnt;
+		qout_h++;
+		qout_armed = 0;
+		if ((uint8_t)(qout_h - qout_t) < QPIPE_OUT_N)
+			QOutArm();
+	}
+}
+
+static uint8_t
+QInPipe(uint8_t *buffer, uint8_t len)
+{
+
+	if ((uint8_t)(qin_h - qin_t) >= QPIPE_IN_N)
+		return (0);
+	if (len > PIPE_1_SZ_IN)
+		len = PIPE_1_SZ_IN;
+	memcpy(QSLOT_IN(qin_h), buffer, len);
+	qin_cnt[qin_h % QPIPE_IN_N] = len;
+	PIE2bits.USBIE = 0;
+	if (qin_h++ == qin_t)
+		QInStart();		// SIE was idle
+	PIE2bits.USBIE = 1;
+	return (len);
+}
+
+static uint8_t
+QOutPipe(uint8_t *buffer, uint8_t len)
+{
+	uint8_t n;
+
+	if (qout_h == qout_t)
+		return (0);
+	n = qout_cnt[qout_t % QPIPE_OUT_N];
+	if (len > n)
+		len = n;
+	memcpy(buffer, QSLOT_OUT(qout_t), len);
+	PIE2bits.USBIE = 0;
+	qout_t++;
+	if (!qout_armed)
+		QOutArm();
+	PIE2bits.USBIE = 1;
+	return (len);
+}
+
 /***********************************************************************
  * Send up to len bytes to the host.  The actual number of bytes sent 
  * is returned to the caller.  If the send failed (usually because a
@@ -192,6 +334,8 @@ uint8_t
 InPipe(uint8_t pipe, uint8_t *buffer, uint8_t len)
 {
 	DBG(DBUG_UCFG, "InPipe(%u,,%u)", (uint16_t)pipe, (uint16_t)len);
+	if (pipe == QPIPE)
+		return (QInPipe(buffer, len));
 	// If the CPU still owns the SIE, then don't try to send anything.
 	if (BDTi(pipe).Stat & UOWN)
 		return 0;
@@ -218,6 +362,9 @@ uint8_t
 OutPipe(uint8_t pipe, uint8_t *buffer, uint8_t len)
 {
 
+	if (pipe == QPIPE)
+		return (QOutPipe(buffer, len));
+
 	// We can only pull data if we own the buffer
 	if(BDTo(pipe).Stat & UOWN)
 		return (0);
@@ -240,32 +387,79 @@ OutPipe(uint8_t pipe, uint8_t *buffer, uint8_t len)
 
 /***********************************************************************
  * After configuration is complete, this routine is called to initialize
- * the endpoints (e.g., assign buffer addresses).
+ * the endpoints (e.g., assign buffer addresses).  BusReset() has
+ * cleared the UEPn registers.
  */
 
-/*lint -e{415,416} */
+#define EP_INIT_OUT_(num, size)						\
+	pipe_out[num] = ep##num##_OUT[0];				\
+	pipe_out_len[num] = size;					\
+	UEP##num |= 0x1c;						\
+	BDTo(num).Cnt = size;						\
+	BDTo(num).Addr = PTR16(ep##num##_OUT[0]);			\
+	BDTo(num).Stat = UOWN | DTSEN;
+
+/* Isochronous endpoints are enabled by SET_INTERFACE, see IsoSelect() */
+#define EP_INIT_IN(num, size, iso)					\
+	pipe_in[num] = ep##num##_IN[0];					\
+	pipe_in_len[num] = size;					\
+	if (!(iso))							\
+		UEP##num |= 0x1a;					\
+	BDTi(num).Addr = PTR16(ep##num##_IN[0]);			\
+	BDTi(num).Stat = (iso) ? 0 : DTS;
+
+#define EP_INIT_OUT(num, size, iso)	EP_INIT_OUT_(num, size)
+
+#define EP_INIT(num, dir, attr, size, ival)				\
+	EP_INIT_##dir(num, size, ((attr) & 0x03) == 0x01)
+
 static void
-InitPipe(uint8_t pipe)
+InitPipes(void)
 {
-	__sfr *uep = &UEP0 + pipe;
 
-	if (pipe_in_len[pipe] == 0 && pipe_out_len[pipe] == 0)
-		return;
-	DBG(DBUG_UCFG, "InitPipe(%u)", pipe);
+	DBG(DBUG_UCFG, "InitPipes()");
+	ENDPOINTS(EP_INIT)
+	QPipeInit();
+}
 
-	// Turn on both in and out for this endpoint
-	*uep = 0x18;
-	if (pipe_in_len[pipe])
-		*uep |= 0x02;
-	if (pipe_out_len[pipe])
-		*uep |= 0x04;
+/***********************************************************************
+ * Isochronous streaming on ISO_INTERFACE
+ *
+ * Each packet starts with a sequence number, so the host can tell a
+ * lost packet from a frame where there was nothing to send.
+ */
 
-	BDTo(pipe).Cnt = pipe_out_len[pipe];
-	BDTo(pipe).Addr = PTR16(pipe_out[pipe]);
-	BDTo(pipe).Stat = UOWN | DTSEN;
+uint8_t isoAlt;			// Alternate setting of ISO_INTERFACE
+static uint8_t isoSeq;
 
-	BDTi(pipe).Addr = PTR16(pipe_in[pipe]);
-	BDTi(pipe).Stat = DTS;
+static void
+IsoSelect(uint8_t alt)
+{
+	__sfr *uep = &UEP0 + ISO_PIPE;
+
+	BDTi(ISO_PIPE).Stat = 0;
+	isoAlt = alt;
+	isoSeq = 0;
+	if (alt)
+		*uep = 0x0a;	// IN, no handshake, no control
+	else
+		*uep = 0x00;
+}
+
+uint8_t
+IsoPipe(uint8_t *buffer, uint8_t len)
+{
+	volatile uint8_t *p = pipe_in[ISO_PIPE];
+
+	if (!isoAlt || (BDTi(ISO_PIPE).Stat & UOWN))
+		return (0);
+	if (len > pipe_in_len[ISO_PIPE] - 1)
+		len = pipe_in_len[ISO_PIPE] - 1;
+	p[0] = isoSeq++;
+	memcpy(p + 1, buffer, len);
+	BDTi(ISO_PIPE).Cnt = len + 1;
+	BDTi(ISO_PIPE).Stat = UOWN;	// DATA0, no toggle checks
+	return (len);
 }
 
 static struct linecoding {
@@ -320,19 +514,20 @@ GetDescriptor(void)
 
 	if (descriptorType == DEVICE_DESCRIPTOR) {
 		requestHandled = 1;
-		outPtr = deviceDescriptor;
+		outPtr = deviceImage;
 		wCount = *(outPtr + 0);
 	} else if (descriptorType == CONFIGURATION_DESCRIPTOR) {
 		requestHandled = 1;
-		outPtr = configDescriptor;
+		outPtr = configImage;
 		wCount = *(outPtr + 2);
 	} else if (descriptorType == STRING_DESCRIPTOR) {
 		requestHandled = 1;
 		if (descriptorIndex >= N_STRING)
 			descriptorIndex = N_STRING - 1;
-		outPtr = stringDescriptors[descriptorIndex];
+		outPtr = stringImage[descriptorIndex];
 		wCount = *outPtr;
 	}
+	outDirect = requestHandled;
 }
 
 // Process GET_STATUS
@@ -359,6 +554,8 @@ GetStatus(void)
 		// Endpoint
 		uint8_t endpointNum = SetupPacket.wIndex0 & 0x0F;
 		uint8_t endpointDir = SetupPacket.wIndex0 & 0x80;
+		if (endpointNum >= N_EP)
+			return;
 		requestHandled = 1;
 		if (endpointDir) {
 			if (BDTi(endpointNum).Stat & BSTALL)
@@ -402,7 +599,8 @@ SetFeature(void)
 		uint8_t endpointDir = SetupPacket.wIndex0 & 0x80;
 		uint8_t c;
 
-		if ((feature == ENDPOINT_HALT) && (endpointNum != 0)) {
+		if ((feature == ENDPOINT_HALT) && (endpointNum != 0) &&
+		    (endpointNum < N_EP)) {
 			// Halt endpoint (as long as it isn't endpoint 0)
 			requestHandled = 1;
 			if(SetupPacket.bRequest == SET_FEATURE)
@@ -457,14 +655,8 @@ ProcessStandardRequest(void)
 			// Set the configuration.
 			NewState(CONFIGURED);
 
-			InitPipe(1);
-			InitPipe(2);
-			InitPipe(3);
-			InitPipe(4);
-			InitPipe(5);
-			InitPipe(6);
-			InitPipe(7);
-			InitPipe(8);
+			InitPipes();
+			IsoSelect(0);
 		}
 	} else if (request == GET_CONFIGURATION) {
 		DBG(DBUG_UCFG, "GET_CONFIGURATION");
@@ -476,18 +668,31 @@ ProcessStandardRequest(void)
 	} else if ((request == CLEAR_FEATURE) || (request == SET_FEATURE)) {
 		SetFeature();
 	} else if (request == GET_INTERFACE) {
-		// No support for alternate interfaces.  Send
-		// zero back to the host.
+		// Only ISO_INTERFACE has alternate settings
 		DBG(DBUG_UCFG, "GET_INTERFACE");
+		if (deviceState != CONFIGURED ||
+		    SetupPacket.wIndex0 >= N_INTERFACE)
+			return;
 		requestHandled = 1;
-		controlTransferBuffer[0] = 0;
+		if (SetupPacket.wIndex0 == ISO_INTERFACE)
+			controlTransferBuffer[0] = isoAlt;
+		else
+			controlTransferBuffer[0] = 0;
 		//typecast below got it working with SDCC 2.8.0 
 		outPtr = controlTransferBuffer;
 		wCount = 1;
 	} else if (request == SET_INTERFACE) {
-		// No support for alternate interfaces - just ignore.
 		DBG(DBUG_UCFG, "SET_INTERFACE");
-		requestHandled = 1;
+		if (deviceState != CONFIGURED ||
+		    SetupPacket.wIndex0 >= N_INTERFACE)
+			return;
+		if (SetupPacket.wIndex0 == ISO_INTERFACE &&
+		    SetupPacket.wValue0 <= 1) {
+			requestHandled = 1;
+			IsoSelect(SetupPacket.wValue0);
+		} else if (SetupPacket.wValue0 == 0) {
+			requestHandled = 1;
+		}
 	} else if (request == SET_DESCRIPTOR) {
 		DBG(DBUG_UCFG, "SET_DESCRIPTOR");
 	} else if (request == SYNCH_FRAME) {
@@ -502,6 +707,8 @@ static void
 InDataStage(void)
 {
 	uint16_t bufferSize;
+
+	USB_PROF_ENTER(PROF_INDATA);
 	// Determine how many bytes are going to the host
 	if(wCount < sizeof controlTransferBuffer)
 		bufferSize = wCount;
@@ -512,16 +719,21 @@ InDataStage(void)
 	BDTi(0).Stat &= ~(BC8 | BC9); // Clear BC8 and BC9
 	BDTi(0).Stat |= (uint8_t)((bufferSize & 0x0300) >> 8);
 	BDTi(0).Cnt = (uint8_t)(bufferSize & 0xFF);
-	BDTi(0).Addr = PTR16(&controlTransferBuffer);
-	// Move data to the USB output buffer from wherever it sits now.
-	inPtr = controlTransferBuffer;
-
-	memcpy(inPtr, outPtr, bufferSize);
+	if (outDirect) {
+		// Descriptor images are sent from where they sit
+		BDTi(0).Addr = PTR16(outPtr);
+	} else {
+		// Move data to the USB output buffer from wherever it sits now.
+		BDTi(0).Addr = PTR16(&controlTransferBuffer);
+		inPtr = controlTransferBuffer;
+		memcpy(inPtr, outPtr, bufferSize);
+	}
 	// Update the number of bytes that still need to be sent.  Getting
 	// all the data back to the host can take multiple transactions, so
 	// we need to track how far along we are.
 	wCount = wCount - bufferSize;
 	outPtr += bufferSize;
+	USB_PROF_EXIT(PROF_INDATA);
 }
 
 // Data stage for a Control Transfer that reads data from the host
@@ -544,6 +756,8 @@ OutDataStage(void)
 static void
 SetupStage(void)
 {
+
+	USB_PROF_ENTER(PROF_SETUP);
 	// Note: Microchip says to turn off the UOWN bit on the IN direction as
 	// soon as possible after detecting that a SETUP has been received.
 	BDTi(0).Stat &= ~UOWN;
@@ -553,6 +767,7 @@ SetupStage(void)
 	ctrlTransferStage = SETUP_STAGE;
 	requestHandled = 0; // Default is that request hasn't been handled
 	wCount = 0;         // No bytes transferred
+	outDirect = 0;
 	// See if this is a standard (as definded in USB chapter 9) request
 	ProcessStandardRequest();
 	// See if the HID class can do something with it.
@@ -575,8 +790,7 @@ SetupStage(void)
 		BDTo(0).Cnt = sizeof controlTransferBuffer;
 		BDTo(0).Addr = PTR16(&SetupPacket);
 		BDTo(0).Stat = UOWN;
-		// Set the in buffer descriptor on endpoint 0 to send data
-		BDTi(0).Addr = PTR16(&controlTransferBuffer);
+		// InDataStage() pointed the in buffer descriptor at the data
 		// Give to SIE, DATA1 packet, enable data toggle checks
 		BDTi(0).Stat = UOWN | DTS | DTSEN; 
 	} else {
@@ -593,6 +807,7 @@ SetupStage(void)
 	}
 	// Enable SIE token and packet processing
 	UCONbits.PKTDIS = 0;
+	USB_PROF_EXIT(PROF_SETUP);
 }
 
 // Configures the buffer descriptor for endpoint 0 so that it is waiting for
@@ -600,6 +815,7 @@ SetupStage(void)
 static void
 WaitForSetupStage(void)
 {
+
 	ctrlTransferStage = SETUP_STAGE;
 	BDTo(0).Cnt = sizeof controlTransferBuffer;
 	BDTo(0).Addr = PTR16(&SetupPacket);
@@ -616,9 +832,9 @@ WaitForSetupStage(void)
  */
 
 static void
-ProcessControlTransfer(void)
+ProcessControlTransfer(uint8_t ustat)
 {   
-	if (USTAT == 0) {
+	if (ustat == 0) {
 		// Endpoint 0:out
 		uint8_t PID = (BDTo(0).Stat & 0x3C) >> 2;
 		    // Pull PID from middle of BD0STAT
@@ -638,18 +854,8 @@ ProcessControlTransfer(void)
 			// Prepare for the Setup stage of a control transfer
 			WaitForSetupStage();
 		}
-	} else if(USTAT == 0x04) {
-		if ((UADDR == 0) && (deviceState == ADDRESS)) {
-			// TBD: ensure that the new address matches the value of
-			// "deviceAddress" (which came in through a SET_ADDRESS).
-			UADDR = SetupPacket.wValue0;
-			if(UADDR == 0) {
-				// If we get a reset after a SET_ADDRESS,
-				// then we need to drop back to the Default
-				// state.
-				NewState(DEFAULT);
-			}  
-		}
+	} else if(ustat == 0x04) {
+		// A SET_ADDRESS was applied by SetAddress() already
 		if (ctrlTransferStage == DATA_IN_STAGE) {
 			// Start (or continue) transmitting data
 			InDataStage();
@@ -659,7 +865,58 @@ ProcessControlTransfer(void)
 			WaitForSetupStage();
 		}
 	} else {
-		DBG(DBUG_UCFG, "USTAT = 0x%uhx", USTAT);
+		DBG(DBUG_UCFG, "USTAT = 0x%uhx", ustat);
+	}
+}
+
+/***********************************************************************
+ * EP0 transactions are only queued by USB_intr(), and processed here,
+ * from the main loop, at most EP0Q_N at a time.  After a SETUP the SIE
+ * holds further packets off with PKTDIS until SetupStage() is done, and
+ * IN/OUT on EP0 are NAK'ed until their buffer descriptor is handed
+ * back, so the host just waits.  USBIE is masked while a transaction
+ * is processed, it shares state with the EP1 completions.
+ *
+ * The one thing that can't wait for the main loop is the new address
+ * after SET_ADDRESS:  USB allows 2ms from the status stage, and a loop
+ * with a flash erase or a long sprintf() in it takes more.
+ */
+
+#define EP0Q_N		4	// Depth of the USTAT FIFO
+
+static uint8_t ep0q[EP0Q_N];
+static volatile uint8_t ep0q_h, ep0q_t;
+
+/* From USB_intr(), when an IN on EP0 completes */
+static void
+SetAddress(void)
+{
+
+	if (UADDR != 0 || deviceState != ADDRESS)
+		return;
+	UADDR = deviceAddress;
+	if (UADDR == 0) {
+		// If we get a reset after a SET_ADDRESS,
+		// then we need to drop back to the Default
+		// state.
+		NewState(DEFAULT);
+	}
+}
+
+void
+USB_task(void)
+{
+	uint8_t n;
+
+	for (n = 0; n < EP0Q_N; n++) {
+		PIE2bits.USBIE = 0;
+		if (ep0q_t == ep0q_h) {
+			PIE2bits.USBIE = 1;
+			break;
+		}
+		ProcessControlTransfer(ep0q[ep0q_t % EP0Q_N]);
+		ep0q_t++;
+		PIE2bits.USBIE = 1;
 	}
 }
 
@@ -678,6 +935,7 @@ EnableUSBModule(void)
 	if(UCONbits.USBEN == 0) {
 		UCON = 0;
 		UIE = 0;
+		DescriptorImages();
 		UCONbits.USBEN = 1;
 		NewState(ATTACHED);
 	}
@@ -770,12 +1028,16 @@ static void
 BusReset()
 {
 
+	USB_PROF_ENTER(PROF_BUSRESET);
 	UEIR  = 0x00;		// Clear all errors
 	UIR   = 0x00;		// Clear all interrupts
 	UEIE  = 0x9f;		// Enable all errors
 	UIE   = 0x3b;		// Enable interrupts but ACTIVEF
 
 	UADDR = 0x00;		// Default address
+	isoAlt = 0;
+	CDC_modem = 0;		// Looks like DTR dropped, to the application
+	ep0q_t = ep0q_h;	// Forget queued EP0 transactions
 
 	/* EP0 is control, disable the rest */
 	UEP0 = 0x16;	UEP4=0x00;	UEP8=0x00;	UEP12=0x00;
@@ -797,6 +1059,7 @@ BusReset()
 	selfPowered = 0;		// Self powered is off by default
 	currentConfiguration = 0;	// Clear active configuration
 	NewState(DEFAULT);
+	USB_PROF_EXIT(PROF_BUSRESET);
 }
 
 /***********************************************************************
@@ -869,8 +1132,13 @@ USB_intr(void)
 		/*
 		 * Transaction finished Interrupt
 		 */
-		if (!(USTAT & 0x78))
-			ProcessControlTransfer();
+		if (!(USTAT & 0x78)) {
+			if (USTAT == 0x04)
+				SetAddress();
+			if ((uint8_t)(ep0q_h - ep0q_t) < EP0Q_N)
+				ep0q[ep0q_h++ % EP0Q_N] = USTAT;
+		} else if ((USTAT & 0x78) == (QPIPE << 3))
+			QPipeDone(USTAT & 0x04);	// DIR: 1 = IN
 		else
 			DBG(DBUG_UNU1, "<TRNIF ustat=%x>", USTAT);
 		UIRbits.TRNIF = 0;
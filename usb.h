@@ -76,6 +76,7 @@ extern uint8_t deviceState;    // Visible device states (from USB 2.0, chap 9.1.
 // extern uint8_t selfPowered;
 extern uint8_t remoteWakeup;
 extern uint8_t currentConfiguration;
+extern uint8_t isoAlt;		// Isochronous streaming selected by host
 
 // Every device request starts with an 8 uint8_t setup packet (USB 2.0, chap 9.3)
 // with a standard layout.  The meaning of wValue and wIndex will
@@ -94,9 +95,11 @@ typedef struct _setupPacketStruct
 
 // USB Functions
 void EnableUSBModule(void);
+void USB_task(void);		// Call from the main loop
 
 // Functions for reading/writing the HID interrupt endpoint
 uint8_t InPipe(uint8_t pipe, uint8_t *buffer, uint8_t len);
 uint8_t OutPipe(uint8_t pipe, uint8_t *buffer, uint8_t len);
+uint8_t IsoPipe(uint8_t *buffer, uint8_t len);
 
 #endif //USB_H
@@ -1,10 +1,16 @@
 
 /**********************************************************************
- * Describe the buffer sizes of the pipes use
+ * Describe the endpoints
  *
- * Don't meddle with pipe0, unless you know what you're doing.
+ * The endpoint tables below are the only place endpoints are listed:
+ * usb.c generates the buffers, the buffer descriptor table and the
+ * endpoint setup from them, and the configuration descriptor further
+ * down pulls its endpoint descriptors from them.  There is one table
+ * per interface, in descriptor order.
+ *
+ *	EP(number, direction, attributes, size, interval)
  *
- * Unused pipes should be set to '0'
+ * Don't meddle with pipe0, unless you know what you're doing.
  */
 
 #define PIPE_0_SZ_IN		64
@@ -14,26 +20,59 @@
 #define PIPE_1_SZ_OUT		64
 
 #define PIPE_2_SZ_IN		8
-#define PIPE_2_SZ_OUT		8
 
-#define PIPE_3_SZ_IN		0
-#define PIPE_3_SZ_OUT		0
+#define PIPE_3_SZ_IN		64	// Reserved every frame
+
+/*
+ * QPIPE is driven by transaction complete interrupts: IN packets are
+ * queued in QPIPE_IN_N buffers and handed to the SIE back to back, OUT
+ * packets are received into QPIPE_OUT_N buffers in turn.
+ */
+#define QPIPE			1
+#define QPIPE_IN_N		4
+#define QPIPE_OUT_N		2
+
+#define EP_NBUF_IN(n)		((n) == QPIPE ? QPIPE_IN_N : 1)
+#define EP_NBUF_OUT(n)		((n) == QPIPE ? QPIPE_OUT_N : 1)
 
-#define PIPE_4_SZ_IN		0
-#define PIPE_4_SZ_OUT		0
+#define EP_ISO			0x05	// Isochronous, asynchronous
+#define EP_BULK			0x02
+#define EP_INTR			0x03
 
-#define PIPE_5_SZ_IN		0
-#define PIPE_5_SZ_OUT		0
+/*
+ * Interface 2 is a vendor data interface for isochronous streaming.
+ * Alternate setting 0 has no endpoints and reserves no bandwidth,
+ * alternate setting 1 has the endpoints in ENDPOINTS_IF2.
+ */
+#define N_INTERFACE		3
+#define ISO_INTERFACE		2
+#define ISO_PIPE		3
+
+#define EP_ADDR_IN(n)		(0x80 | (n))
+#define EP_ADDR_OUT(n)		(n)
+
+#define ENDPOINTS_IF0(EP)						\
+	EP(2,	IN,	EP_INTR,	PIPE_2_SZ_IN,	0xff)
 
-#define PIPE_6_SZ_IN		0
-#define PIPE_6_SZ_OUT		0
+#define ENDPOINTS_IF1(EP)						\
+	EP(1,	OUT,	EP_BULK,	PIPE_1_SZ_OUT,	0x00)		\
+	EP(1,	IN,	EP_BULK,	PIPE_1_SZ_IN,	0x00)
 
-#define PIPE_7_SZ_IN		0
-#define PIPE_7_SZ_OUT		0
+#define ENDPOINTS_IF2(EP)						\
+	EP(3,	IN,	EP_ISO,		PIPE_3_SZ_IN,	0x01)
 
-#define PIPE_8_SZ_IN		0
-#define PIPE_8_SZ_OUT		0
+#define ENDPOINTS(EP)							\
+	ENDPOINTS_IF0(EP) ENDPOINTS_IF1(EP) ENDPOINTS_IF2(EP)
 
+#define EP_COUNT(num, dir, attr, size, ival)	+ 1
+
+#define EP_DESC(num, dir, attr, size, ival)				\
+	0x07,			/* bLength */				\
+	ENDPOINT_DESCRIPTOR,	/* bDescriptorType (Endpoint) */	\
+	EP_ADDR_##dir(num),	/* bEndpointAddress */			\
+	attr,			/* bmAttributes */			\
+	W16(size),		/* wMaxPacketSize */			\
+	ival,			/* bInterval (* 1 millisecond) */
 
 static const code uint8_t deviceDescriptor[] =
 {
@@ -60,7 +99,7 @@ static const code uint8_t configDescriptor[] = {
 	0x09,			// bLength,
 	0x02,			// bDescriptorType (Configuration)
 	W16(sizeof configDescriptor),	// wTotalLength
-	0x02,			// bNumInterfaces,
+	N_INTERFACE,		// bNumInterfaces,
 	0x01,			// bConfigurationValue
 	0x00,			// iConfiguration,
 	0xA0,			// bmAttributes ()
@@ -71,7 +110,7 @@ static const code uint8_t configDescriptor[] = {
 	INTERFACE_DESCRIPTOR,	// bDescriptorType (Interface)
 	0x00,			// bInterfaceNumber,
 	0x00,			// bAlternateSetting
-	0x01,			// bNumEndpoints,
+	0 ENDPOINTS_IF0(EP_COUNT),	// bNumEndpoints,
 	0x02,			// bInterfaceClass
 	0x02,			// bInterfaceSubclass,
 	0x01,			// bInterfaceProtocol,
@@ -103,40 +142,44 @@ static const code uint8_t configDescriptor[] = {
 	0x00,			// Master
 	0x01,			// Slave
 
-	// Endpoint 
-	0x07,			// bLength,
-	ENDPOINT_DESCRIPTOR,	// bDescriptorType (Endpoint)
-	0x82,			// bEndpointAddress
-	0x03,			// bmAttributes (Interrupt)
-	W16(8),			// wmaxPacketSize,
-	0xff,			// bInterval (* 1 millisecond)
+	ENDPOINTS_IF0(EP_DESC)
 
 	// Data Interface descriptor
 	0x09,			// bLength,
 	INTERFACE_DESCRIPTOR,	// bDescriptorType (Interface)
 	0x01,			// bInterfaceNumber,
 	0x00,			// bAlternateSetting
-	0x02,			// bNumEndpoints,
+	0 ENDPOINTS_IF1(EP_COUNT),	// bNumEndpoints,
 	0x0a,			// bInterfaceClass
 	0x00,			// bInterfaceSubclass,
 	0x00,			// bInterfaceProtocol,
 	0x00,			// iInterface
 
-	// Endpoint
-	0x07,			// bLength,
-	ENDPOINT_DESCRIPTOR,	// bDescriptorType (Endpoint)
-	0x01,			// bEndpointAddress
-	0x02,			// bmAttributes (Interrupt)
-	W16(PIPE_1_SZ_IN),	// wmaxPacketSize,
-	0x00,			// bInterval (1 millisecond)
-
-	// Endpoint
-	0x07,			// bLength,
-	ENDPOINT_DESCRIPTOR,	// bDescriptorType (Endpoint)
-	0x81,			// bEndpointAddress
-	0x02,			// bmAttributes (Interrupt)
-	W16(PIPE_1_SZ_OUT),	// wmaxPacketSize,
-	0x00,			// bInterval (1 millisecond)
+	ENDPOINTS_IF1(EP_DESC)
+
+	// Streaming Interface descriptor, idle
+	0x09,			// bLength,
+	INTERFACE_DESCRIPTOR,	// bDescriptorType (Interface)
+	ISO_INTERFACE,		// bInterfaceNumber,
+	0x00,			// bAlternateSetting
+	0x00,			// bNumEndpoints,
+	0xff,			// bInterfaceClass (Vendor)
+	0x00,			// bInterfaceSubclass,
+	0x00,			// bInterfaceProtocol,
+	0x00,			// iInterface
+
+	// Streaming Interface descriptor, isochronous
+	0x09,			// bLength,
+	INTERFACE_DESCRIPTOR,	// bDescriptorType (Interface)
+	ISO_INTERFACE,		// bInterfaceNumber,
+	0x01,			// bAlternateSetting
+	0 ENDPOINTS_IF2(EP_COUNT),	// bNumEndpoints,
+	0xff,			// bInterfaceClass (Vendor)
+	0x00,			// bInterfaceSubclass,
+	0x00,			// bInterfaceProtocol,
+	0x00,			// iInterface
+
+	ENDPOINTS_IF2(EP_DESC)
 };
 
 static const code uint8_t stringDescriptor0[] = {